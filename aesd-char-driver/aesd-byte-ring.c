@@ -0,0 +1,211 @@
+/**
+ * @file aesd-byte-ring.c
+ * @brief Byte bounded circular buffer of records
+ *
+ * Any necessary locking must be performed by the caller.
+ *
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+// Zeroed and page aligned, so the ring can be mapped to user space
+#define ring_alloc(size) vmalloc_user(size)
+#define ring_free(ptr) vfree(ptr)
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#define ring_alloc(size) calloc(1, size)
+#define ring_free(ptr) free(ptr)
+#endif
+
+#include "aesd-byte-ring.h"
+
+static size_t round_up_power_of_two(size_t n)
+{
+    size_t power = 1;
+
+    while (power < n)
+        power <<= 1;
+    return power;
+}
+
+/**
+ * Initializes @param ring to hold @param data_size bytes in at most @param max_records records,
+ * both rounded up to a power of two.
+ * @return 0 on success, -ENOMEM if the allocation failed
+ */
+int aesd_byte_ring_init(struct aesd_byte_ring *ring, size_t data_size, size_t max_records)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->data_size = round_up_power_of_two(data_size ? data_size : 1);
+    ring->max_records = round_up_power_of_two(max_records ? max_records : 1);
+    ring->data = ring_alloc(ring->data_size);
+    ring->record_start = ring_alloc(ring->max_records * sizeof(size_t));
+    if (ring->data == NULL || ring->record_start == NULL)
+    {
+        aesd_byte_ring_cleanup(ring);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Frees the memory allocated in aesd_byte_ring_init()
+ */
+void aesd_byte_ring_cleanup(struct aesd_byte_ring *ring)
+{
+    ring_free(ring->data);
+    ring_free(ring->record_start);
+    ring->data = NULL;
+    ring->record_start = NULL;
+}
+
+/**
+ * Makes room for a record of @param size bytes in @param ring, evicting the oldest records as needed.
+ * The record is to be written at @param data_rtn for @param first_part_rtn bytes, then at the start of
+ * ring->data for the remaining bytes when it wraps around, and added with aesd_byte_ring_commit().
+ * @return 0 on success, -EFBIG if the record is larger than the ring
+ */
+int aesd_byte_ring_reserve(struct aesd_byte_ring *ring, size_t size, char **data_rtn, size_t *first_part_rtn)
+{
+    if (size > ring->data_size)
+    {
+        return -EFBIG;
+    }
+
+    // Evict until there is room for both the bytes and the record start
+    while (ring->head + size - ring->tail > ring->data_size ||
+           ring->next_record - ring->first_record == ring->max_records)
+    {
+        ring->first_record++;
+        ring->tail = ring->first_record == ring->next_record ? ring->head :
+            ring->record_start[ring->first_record & (ring->max_records - 1)];
+    }
+
+    // The record is written in two parts when it wraps around the end of the ring
+    size_t pos = ring->head & (ring->data_size - 1);
+    *first_part_rtn = ring->data_size - pos;
+    if (*first_part_rtn > size)
+    {
+        *first_part_rtn = size;
+    }
+    *data_rtn = ring->data + pos;
+    return 0;
+}
+
+/**
+ * Adds the record of @param size bytes written after aesd_byte_ring_reserve() to @param ring
+ */
+void aesd_byte_ring_commit(struct aesd_byte_ring *ring, size_t size)
+{
+    ring->record_start[ring->next_record & (ring->max_records - 1)] = ring->head;
+    ring->next_record++;
+    ring->head += size;
+}
+
+/**
+ * Copies the @param size bytes at @param record to @param ring as a new record,
+ * evicting the oldest records as needed.
+ * @return 0 on success, -EFBIG if the record is larger than the ring
+ */
+int aesd_byte_ring_add(struct aesd_byte_ring *ring, const char *record, size_t size)
+{
+    char *data;
+    size_t first_part;
+    int err = aesd_byte_ring_reserve(ring, size, &data, &first_part);
+
+    if (err)
+    {
+        return err;
+    }
+    memcpy(data, record, first_part);
+    memcpy(ring->data, record + first_part, size - first_part);
+    aesd_byte_ring_commit(ring, size);
+    return 0;
+}
+
+/**
+ * Finds the bytes at @param char_offset, the zero referenced character index if all records
+ * were concatenated end to end.
+ * @param data_rtn is set to the location of the byte at char_offset
+ * @return the number of contiguous bytes available at data_rtn, which may span several records,
+ * or 0 if this position is not available in the ring
+ */
+size_t aesd_byte_ring_peek(const struct aesd_byte_ring *ring, size_t char_offset, const char **data_rtn)
+{
+    if (char_offset >= ring->head - ring->tail)
+    {
+        return 0;
+    }
+
+    size_t pos = (ring->tail + char_offset) & (ring->data_size - 1);
+    size_t available = ring->head - ring->tail - char_offset;
+    if (available > ring->data_size - pos)
+    {
+        available = ring->data_size - pos;
+    }
+    *data_rtn = ring->data + pos;
+    return available;
+}
+
+/**
+ * @return the zero referenced record holding @param char_offset, counting from the oldest record
+ * stored, or the number of records if this position is not available in @param ring
+ */
+size_t aesd_byte_ring_record_index(const struct aesd_byte_ring *ring, size_t char_offset)
+{
+    size_t count = ring->next_record - ring->first_record;
+
+    if (char_offset >= ring->head - ring->tail)
+    {
+        return count;
+    }
+
+    // Binary search of the last record starting at or before char_offset
+    size_t target = ring->tail + char_offset;
+    size_t low = 0;
+    size_t high = count - 1;
+    while (low < high)
+    {
+        size_t mid = low + (high - low + 1) / 2;
+        if (ring->record_start[(ring->first_record + mid) & (ring->max_records - 1)] <= target)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * Converts a position given as a record number, counting from the oldest record stored,
+ * and an offset in this record into a char offset for aesd_byte_ring_peek().
+ * @return false if @param record_index or @param record_offset are out of range
+ */
+bool aesd_byte_ring_fpos_for_record(const struct aesd_byte_ring *ring, uint32_t record_index,
+            size_t record_offset, size_t *char_offset_rtn)
+{
+    size_t record = ring->first_record + record_index;
+
+    if (record_index >= ring->next_record - ring->first_record)
+    {
+        return false;
+    }
+
+    size_t start = ring->record_start[record & (ring->max_records - 1)];
+    size_t end = record + 1 == ring->next_record ? ring->head :
+        ring->record_start[(record + 1) & (ring->max_records - 1)];
+    if (record_offset >= end - start)
+    {
+        return false;
+    }
+
+    *char_offset_rtn = start - ring->tail + record_offset;
+    return true;
+}
@@ -0,0 +1,93 @@
+/*
+ * aesd-byte-ring.h
+ *
+ *  A circular buffer bounded by bytes instead of entries.
+ *
+ *  Records are copied back to back into a single power of two sized byte ring,
+ *  with a ring of record start offsets alongside. Adding a record evicts as many
+ *  old records as needed to make room for it, so memory use is fixed and short
+ *  records get a deep history.
+ */
+
+#ifndef AESD_BYTE_RING_H
+#define AESD_BYTE_RING_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <stdbool.h>
+#endif
+
+struct aesd_byte_ring
+{
+    /**
+     * The byte ring, data_size bytes
+     */
+    char *data;
+    /**
+     * Size of data, a power of two
+     */
+    size_t data_size;
+    /**
+     * Stream offset of each record, indexed by record number modulo max_records
+     */
+    size_t *record_start;
+    /**
+     * Maximum number of records stored, a power of two
+     */
+    size_t max_records;
+    /**
+     * Number of the oldest record stored, records are numbered from 0 since init
+     */
+    size_t first_record;
+    /**
+     * Number of the next record to add
+     */
+    size_t next_record;
+    /**
+     * Stream offset of the first byte of the oldest record. Stream offsets count
+     * the bytes added since init, the ring position is the stream offset modulo data_size.
+     */
+    size_t tail;
+    /**
+     * Stream offset of the next byte to add
+     */
+    size_t head;
+};
+
+extern int aesd_byte_ring_init(struct aesd_byte_ring *ring, size_t data_size, size_t max_records);
+
+extern void aesd_byte_ring_cleanup(struct aesd_byte_ring *ring);
+
+extern int aesd_byte_ring_reserve(struct aesd_byte_ring *ring, size_t size, char **data_rtn, size_t *first_part_rtn);
+
+extern void aesd_byte_ring_commit(struct aesd_byte_ring *ring, size_t size);
+
+extern int aesd_byte_ring_add(struct aesd_byte_ring *ring, const char *record, size_t size);
+
+extern size_t aesd_byte_ring_peek(const struct aesd_byte_ring *ring, size_t char_offset, const char **data_rtn);
+
+extern size_t aesd_byte_ring_record_index(const struct aesd_byte_ring *ring, size_t char_offset);
+
+extern bool aesd_byte_ring_fpos_for_record(const struct aesd_byte_ring *ring, uint32_t record_index,
+            size_t record_offset, size_t *char_offset_rtn);
+
+/**
+ * @return the number of bytes stored in @param ring
+ */
+static inline size_t aesd_byte_ring_total_size(const struct aesd_byte_ring *ring)
+{
+    return ring->head - ring->tail;
+}
+
+/**
+ * @return the number of records stored in @param ring
+ */
+static inline size_t aesd_byte_ring_record_count(const struct aesd_byte_ring *ring)
+{
+    return ring->next_record - ring->first_record;
+}
+
+#endif /* AESD_BYTE_RING_H */
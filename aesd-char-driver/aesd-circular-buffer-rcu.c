@@ -0,0 +1,205 @@
+/**
+ * @file aesd-circular-buffer-rcu.c
+ * @brief Lockless readers for the aesd circular buffer
+ *
+ * The single writer updates the buffer inside a write section of a sequence counter.
+ * Readers retry their lookup until they observe a stable sequence, then pin the
+ * payload of the entry found with refcount_inc_not_zero(). Payloads are freed after
+ * an RCU grace period, so a reader inside rcu_read_lock() can always safely look at
+ * the refcount of an entry the writer has just overwritten.
+ *
+ * Payloads of up to AESD_RCU_PAYLOAD_CACHE_SIZE bytes come from a dedicated slab
+ * cache, larger ones from kmalloc. A cached payload overwritten in the circular
+ * buffer is handed back to the writer for its next command when no reader holds
+ * it. Since such memory is reused without a grace period, readers check the
+ * sequence again once the payload is pinned.
+ *
+ */
+
+#include <linux/slab.h>
+#include <linux/overflow.h>
+#include <linux/atomic.h>
+
+#include "aesd-circular-buffer-rcu.h"
+
+static struct kmem_cache *aesd_payload_cache;
+
+static atomic_long_t stat_cache_allocs = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_kmalloc_allocs = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_recycled = ATOMIC_LONG_INIT(0);
+static atomic_long_t stat_frees = ATOMIC_LONG_INIT(0);
+
+static inline struct aesd_rcu_payload *to_payload(const char *buffptr)
+{
+    return container_of(buffptr, struct aesd_rcu_payload, data[0]);
+}
+
+int aesd_rcu_payload_cache_init(void)
+{
+    aesd_payload_cache = kmem_cache_create("aesdchar_payload",
+            struct_size((struct aesd_rcu_payload *)NULL, data, AESD_RCU_PAYLOAD_CACHE_SIZE), 0, 0, NULL);
+    return aesd_payload_cache ? 0 : -ENOMEM;
+}
+
+void aesd_rcu_payload_cache_destroy(void)
+{
+    // Wait for the payloads still queued for freeing by call_rcu()
+    rcu_barrier();
+    kmem_cache_destroy(aesd_payload_cache);
+    aesd_payload_cache = NULL;
+}
+
+void aesd_rcu_payload_stats(struct aesd_rcu_payload_stats *stats)
+{
+    stats->cache_allocs = atomic_long_read(&stat_cache_allocs);
+    stats->kmalloc_allocs = atomic_long_read(&stat_kmalloc_allocs);
+    stats->recycled = atomic_long_read(&stat_recycled);
+    stats->frees = atomic_long_read(&stat_frees);
+}
+
+char *aesd_rcu_payload_alloc(size_t size, gfp_t flags)
+{
+    struct aesd_rcu_payload *payload;
+
+    if (size <= AESD_RCU_PAYLOAD_CACHE_SIZE) {
+        payload = kmem_cache_alloc(aesd_payload_cache, flags);
+        if (payload == NULL)
+            return NULL;
+        payload->cached = true;
+        payload->capacity = AESD_RCU_PAYLOAD_CACHE_SIZE;
+        atomic_long_inc(&stat_cache_allocs);
+    } else {
+        payload = kmalloc(struct_size(payload, data, size), flags);
+        if (payload == NULL)
+            return NULL;
+        payload->cached = false;
+        payload->capacity = size;
+        atomic_long_inc(&stat_kmalloc_allocs);
+    }
+    refcount_set(&payload->refcount, 1);
+    return payload->data;
+}
+
+char *aesd_rcu_payload_realloc(char *buffptr, size_t size, gfp_t flags)
+{
+    struct aesd_rcu_payload *payload;
+    char *new_buffptr;
+
+    if (buffptr == NULL)
+        return aesd_rcu_payload_alloc(size, flags);
+
+    payload = to_payload(buffptr);
+    if (size <= payload->capacity)
+        return buffptr;
+
+    if (!payload->cached) {
+        // Never published nor recycled, no reader can be looking at it
+        payload = krealloc(payload, struct_size(payload, data, size), flags);
+        if (payload == NULL)
+            return NULL;
+        payload->capacity = size;
+        return payload->data;
+    }
+
+    // A recycled payload may still be transiently pinned by a reader, move to a new one
+    new_buffptr = aesd_rcu_payload_alloc(size, flags);
+    if (new_buffptr == NULL)
+        return NULL;
+    memcpy(new_buffptr, buffptr, payload->capacity);
+    aesd_rcu_payload_put(buffptr);
+    return new_buffptr;
+}
+
+static void aesd_rcu_payload_free(struct rcu_head *rcu)
+{
+    struct aesd_rcu_payload *payload = container_of(rcu, struct aesd_rcu_payload, rcu);
+
+    if (payload->cached)
+        kmem_cache_free(aesd_payload_cache, payload);
+    else
+        kfree(payload);
+}
+
+void aesd_rcu_payload_put(const char *buffptr)
+{
+    struct aesd_rcu_payload *payload;
+
+    if (buffptr == NULL)
+        return;
+    payload = to_payload(buffptr);
+    if (refcount_dec_and_test(&payload->refcount)) {
+        atomic_long_inc(&stat_frees);
+        call_rcu(&payload->rcu, aesd_rcu_payload_free);
+    }
+}
+
+char *aesd_circular_buffer_rcu_add_entry(struct aesd_circular_buffer *buffer, seqcount_mutex_t *seq,
+            const struct aesd_buffer_entry *add_entry)
+{
+    struct aesd_rcu_payload *payload;
+    const char *evicted;
+
+    write_seqcount_begin(seq);
+    evicted = aesd_circular_buffer_add_entry(buffer, add_entry);
+    write_seqcount_end(seq);
+
+    if (evicted == NULL)
+        return NULL;
+
+    // Readers which already pinned the evicted entry keep it alive until they are done
+    payload = to_payload(evicted);
+    if (!payload->cached) {
+        aesd_rcu_payload_put(evicted);
+        return NULL;
+    }
+    if (!refcount_dec_and_test(&payload->refcount))
+        return NULL;
+    refcount_set(&payload->refcount, 1);
+    atomic_long_inc(&stat_recycled);
+    return payload->data;
+}
+
+const char *aesd_circular_buffer_rcu_find_get(struct aesd_circular_buffer *buffer, seqcount_mutex_t *seq,
+            size_t stream_offset, size_t *entry_offset_byte_rtn, size_t *entry_size_rtn)
+{
+    struct aesd_buffer_entry *entry;
+    const char *buffptr;
+    size_t entry_offset = 0;
+    size_t size = 0;
+    size_t base;
+    unsigned int start;
+
+    rcu_read_lock();
+    while (1) {
+        do {
+            start = read_seqcount_begin(seq);
+            buffptr = NULL;
+            entry = NULL;
+            base = buffer->written_size - buffer->total_size;
+            if (stream_offset >= base)
+                entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, stream_offset - base, &entry_offset);
+            if (entry != NULL) {
+                buffptr = READ_ONCE(entry->buffptr);
+                size = READ_ONCE(entry->size);
+            }
+        } while (read_seqcount_retry(seq, start));
+
+        if (buffptr == NULL)
+            break;
+
+        // A zero refcount means the entry was overwritten since, look it up again
+        if (refcount_inc_not_zero(&to_payload(buffptr)->refcount)) {
+            // The payload may have been overwritten and recycled before it was pinned
+            if (!read_seqcount_retry(seq, start))
+                break;
+            aesd_rcu_payload_put(buffptr);
+        }
+    }
+    rcu_read_unlock();
+
+    if (buffptr != NULL) {
+        *entry_offset_byte_rtn = entry_offset;
+        *entry_size_rtn = size;
+    }
+    return buffptr;
+}
@@ -0,0 +1,117 @@
+/*
+ * aesd-circular-buffer-rcu.h
+ *
+ *  Lockless reader support for the aesd circular buffer, kernel only.
+ *
+ *  The writer keeps using struct aesd_circular_buffer under its own lock and
+ *  publishes every update through a sequence counter. Readers take a consistent
+ *  view of an entry without the lock and pin its payload with a reference, so an
+ *  entry overwritten by the writer is only freed once the last reader is done
+ *  and an RCU grace period has elapsed.
+ */
+
+#ifndef AESD_CIRCULAR_BUFFER_RCU_H
+#define AESD_CIRCULAR_BUFFER_RCU_H
+
+#include <linux/types.h>
+#include <linux/refcount.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+
+#include "aesd-circular-buffer.h"
+
+/**
+ * Payloads up to this size are allocated from a dedicated slab cache and recycled
+ */
+#define AESD_RCU_PAYLOAD_CACHE_SIZE 224
+
+/**
+ * Header of the memory referenced by the buffptr of an entry, see aesd_rcu_payload_alloc()
+ */
+struct aesd_rcu_payload
+{
+    /**
+     * One reference is held by the circular buffer, plus one per reader copying the data
+     */
+    refcount_t refcount;
+    /**
+     * Number of bytes available in data
+     */
+    u32 capacity;
+    /**
+     * Allocated from the payload slab cache rather than kmalloc
+     */
+    bool cached;
+    struct rcu_head rcu;
+    char data[];
+};
+
+/**
+ * Allocation counters of the payloads, see aesd_rcu_payload_stats()
+ */
+struct aesd_rcu_payload_stats
+{
+    long cache_allocs;
+    long kmalloc_allocs;
+    long recycled;
+    long frees;
+};
+
+/**
+ * Creates the payload slab cache, must be called before any other function of this file.
+ * @return 0 on success or -ENOMEM
+ */
+extern int aesd_rcu_payload_cache_init(void);
+
+/**
+ * Destroys the payload slab cache once every payload has been put
+ */
+extern void aesd_rcu_payload_cache_destroy(void);
+
+/**
+ * Fills @param stats with the current allocation counters
+ */
+extern void aesd_rcu_payload_stats(struct aesd_rcu_payload_stats *stats);
+
+/**
+ * Allocates @param size bytes to be stored as an entry buffptr, with a single reference.
+ * @return a pointer to the data, or NULL if the allocation failed
+ */
+extern char *aesd_rcu_payload_alloc(size_t size, gfp_t flags);
+
+/**
+ * Resizes the payload at @param buffptr, which may be NULL, to at least @param size bytes, keeping
+ * its content. Only valid while the payload has not been added to a circular buffer yet.
+ * @return a pointer to the data, or NULL if the allocation failed and @param buffptr is unchanged
+ */
+extern char *aesd_rcu_payload_realloc(char *buffptr, size_t size, gfp_t flags);
+
+/**
+ * Drops a reference to the payload whose data starts at @param buffptr, freeing it after
+ * an RCU grace period when it was the last one.
+ */
+extern void aesd_rcu_payload_put(const char *buffptr);
+
+/**
+ * Adds @param add_entry to @param buffer like aesd_circular_buffer_add_entry(), publishing the
+ * change through @param seq and dropping the reference of the overwritten entry if any.
+ * The caller must hold the mutex associated with @param seq.
+ * @return the memory of the overwritten entry with a single reference, to be reused with
+ * aesd_rcu_payload_realloc(), when it came from the slab cache and no reader holds it. NULL otherwise.
+ */
+extern char *aesd_circular_buffer_rcu_add_entry(struct aesd_circular_buffer *buffer, seqcount_mutex_t *seq,
+            const struct aesd_buffer_entry *add_entry);
+
+/**
+ * Lockless version of aesd_circular_buffer_find_entry_offset_for_fpos(). Can run concurrently
+ * with aesd_circular_buffer_rcu_add_entry().
+ * @param stream_offset the position to search for, counting all the bytes added since the buffer was
+ *      initialized rather than from the oldest entry, so it is not shifted by concurrent writes
+ * @param entry_size_rtn is set to the size of the entry found
+ * @return the buffptr of the entry holding @param stream_offset with a reference the caller must drop
+ * with aesd_rcu_payload_put(), or NULL if this position is not available in the buffer
+ */
+extern const char *aesd_circular_buffer_rcu_find_get(struct aesd_circular_buffer *buffer, seqcount_mutex_t *seq,
+            size_t stream_offset, size_t *entry_offset_byte_rtn, size_t *entry_size_rtn);
+
+#endif /* AESD_CIRCULAR_BUFFER_RCU_H */
@@ -9,18 +9,26 @@
  */
 
 #ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
 #include <linux/string.h>
+#define entries_alloc(count) kcalloc(count, sizeof(struct aesd_buffer_entry), GFP_KERNEL)
+#define entries_free(ptr) kfree(ptr)
 #else
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
+#define entries_alloc(count) calloc(count, sizeof(struct aesd_buffer_entry))
+#define entries_free(ptr) free(ptr)
+// Only the kernel module logs
+#define printk(...) do { } while (0)
+#define KERN_ERR
+#define KERN_INFO
 #endif
 
-#include <linux/slab.h>
-#include <linux/printk.h>
-
 #include "aesd-circular-buffer.h"
 
-static uint8_t circular_buffer_size = AESDCHAR_DEFAULT_MAX_WRITE_OPERATIONS_SUPPORTED;
-
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
  * @param char_offset the position to search for in the buffer list, describing the zero referenced
@@ -34,43 +42,88 @@ static uint8_t circular_buffer_size = AESDCHAR_DEFAULT_MAX_WRITE_OPERATIONS_SUPP
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    size_t total_chars = 0;
-    size_t start_entry = buffer->out_offs;
+    if (char_offset >= buffer->total_size)
+    {
+        return NULL;
+    }
+
+    uint8_t entry_index = aesd_circular_buffer_entry_index_for_fpos(buffer, char_offset);
+    struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + entry_index) % buffer->capacity];
+    *entry_offset_byte_rtn = buffer->entry[buffer->out_offs].cumulative_offs + char_offset - entry->cumulative_offs;
+    return entry;
+}
+
+/**
+ * @return the zero referenced entry holding @param char_offset, counting from the oldest one in
+ * @param buffer, or the number of entries if this position is not available in the buffer
+ */
+uint8_t aesd_circular_buffer_entry_index_for_fpos(struct aesd_circular_buffer *buffer, size_t char_offset)
+{
+    uint8_t count = aesd_circular_buffer_entry_count(buffer);
 
-    // Loop through the entries starting from buffer->out_offs
-    size_t i = 0;
-    for (i = start_entry; i < circular_buffer_size + start_entry; ++i)
+    if (count == 0 || char_offset >= buffer->total_size)
     {
-        // Calculate the index taking into account wrapping around to the beginning
-        size_t index = i % circular_buffer_size;
+        return count;
+    }
+
+    // Position of char_offset in the stream of all the bytes ever added
+    size_t target = buffer->entry[buffer->out_offs].cumulative_offs + char_offset;
 
-        // Check if the entry at this index is empty
-        if (buffer->entry[index].buffptr == NULL)
+    // Binary search of the last entry, in insertion order, starting at or before target
+    uint8_t low = 0;
+    uint8_t high = count - 1;
+    while (low < high)
+    {
+        uint8_t mid = low + (high - low + 1) / 2;
+        size_t index = (buffer->out_offs + mid) % buffer->capacity;
+        if (buffer->entry[index].cumulative_offs <= target)
         {
-            // If we've searched all entries, exit the loop
-            if (i == start_entry + circular_buffer_size - 1)
-            {
-                break;
-            }
-            continue;
+            low = mid;
         }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
 
-        // Calculate the total chars including the current entry
-        total_chars += buffer->entry[index].size;
+/**
+ * @return the number of entries currently stored in @param buffer
+ */
+uint8_t aesd_circular_buffer_entry_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full)
+    {
+        return buffer->capacity;
+    }
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
 
-        // Check if the char_offset is within this entry
-        if (char_offset < total_chars)
-        {
-            // Calculate the byte offset within the entry
-            *entry_offset_byte_rtn = char_offset - (total_chars - buffer->entry[index].size);
+/**
+ * Converts a position given as a write command into a char offset, without walking the entries.
+ * @param entry_index the zero referenced entry, counting from the oldest one in @param buffer
+ * @param entry_offset the zero referenced byte within this entry
+ * @param char_offset_rtn is set to the matching char offset, as used by
+ *      aesd_circular_buffer_find_entry_offset_for_fpos()
+ * @return false if @param entry_index or @param entry_offset are out of range
+ */
+bool aesd_circular_buffer_fpos_for_entry(const struct aesd_circular_buffer *buffer, uint32_t entry_index,
+            size_t entry_offset, size_t *char_offset_rtn)
+{
+    if (entry_index >= aesd_circular_buffer_entry_count(buffer))
+    {
+        return false;
+    }
 
-            // Return a pointer to the corresponding entry structure
-            return &buffer->entry[index];
-        }
+    const struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + entry_index) % buffer->capacity];
+    if (entry_offset >= entry->size)
+    {
+        return false;
     }
 
-    // If char_offset is not found in any entry, return NULL
-    return NULL;
+    *char_offset_rtn = entry->cumulative_offs - buffer->entry[buffer->out_offs].cumulative_offs + entry_offset;
+    return true;
 }
 
 /**
@@ -88,17 +141,22 @@ const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     {
         // Mark the oldest entry as unused and return pointer to be freed
         ret_val = buffer->entry[buffer->out_offs].buffptr;
+        buffer->total_size -= buffer->entry[buffer->out_offs].size;
         buffer->entry[buffer->out_offs].buffptr = NULL;
         buffer->entry[buffer->out_offs].size = 0;
         // Advance out_offs to the next index
-        buffer->out_offs = (buffer->out_offs + 1) % circular_buffer_size;
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
     }
 
     // Copy data from the new entry to the current input position and advance in_offs
     buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
     buffer->entry[buffer->in_offs].size = add_entry->size;
+    buffer->entry[buffer->in_offs].cumulative_offs = buffer->written_size;
+    buffer->total_size += add_entry->size;
+    buffer->written_size += add_entry->size;
+    buffer->written_count++;
     // Advance in_offs to the next index
-    buffer->in_offs = (buffer->in_offs + 1) % circular_buffer_size;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
 
     // Mark the buffer as full if in_offs reaches out_offs
     if (buffer->in_offs == buffer->out_offs)
@@ -115,14 +173,10 @@ const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint8_t m_circular_buffer_size)
 {
-    circular_buffer_size = m_circular_buffer_size;
-
-    if (buffer->entry != NULL)
-    {
-        kfree((void*)buffer->entry);
-    }
+    entries_free(buffer->entry);
 
-    buffer->entry = kmalloc(circular_buffer_size * sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    buffer->capacity = m_circular_buffer_size;
+    buffer->entry = entries_alloc(buffer->capacity);
 
     if (buffer->entry == NULL)
     {
@@ -130,12 +184,54 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint8_t m_ci
         return;
     }
 
-    memset(buffer->entry, 0, circular_buffer_size * sizeof(struct aesd_buffer_entry));
     buffer->in_offs = 0;
     buffer->out_offs = 0;
     buffer->full = false;
-    
-    printk(KERN_INFO "AESD circular buffer initialized with size %d", circular_buffer_size);
+    buffer->total_size = 0;
+    buffer->written_size = 0;
+    buffer->written_count = 0;
+
+    printk(KERN_INFO "AESD circular buffer initialized with size %d", buffer->capacity);
+}
+
+/**
+* Changes the number of entries of @param buffer to @param new_size.
+* The newest entries, up to new_size, are moved to a new entry array, and the buffptr of the
+* older ones is passed to @param free_buffptr. The sizes and offsets of the bytes kept are unchanged.
+* Any necessary locking must be handled by the caller
+* @return 0 on success, or -ENOMEM if the entry array could not be allocated, leaving the buffer unchanged
+*/
+int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint8_t new_size,
+            void (*free_buffptr)(const char *buffptr))
+{
+    struct aesd_buffer_entry *new_entry = entries_alloc(new_size);
+    uint8_t entry_count = aesd_circular_buffer_entry_count(buffer);
+    uint8_t keep = entry_count < new_size ? entry_count : new_size;
+    uint8_t index;
+
+    if (new_entry == NULL)
+    {
+        return -ENOMEM;
+    }
+
+    for (index = 0; index < entry_count - keep; index++)
+    {
+        struct aesd_buffer_entry *entry = &buffer->entry[(buffer->out_offs + index) % buffer->capacity];
+        buffer->total_size -= entry->size;
+        free_buffptr(entry->buffptr);
+    }
+    for (index = 0; index < keep; index++)
+    {
+        new_entry[index] = buffer->entry[(buffer->out_offs + entry_count - keep + index) % buffer->capacity];
+    }
+
+    entries_free(buffer->entry);
+    buffer->entry = new_entry;
+    buffer->capacity = new_size;
+    buffer->out_offs = 0;
+    buffer->in_offs = keep % new_size;
+    buffer->full = keep == new_size;
+    return 0;
 }
 
 /**
@@ -143,5 +239,6 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint8_t m_ci
 */
 void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer)
 {
-    kfree((void*)buffer->entry);
+    entries_free(buffer->entry);
+    buffer->entry = NULL;
 }
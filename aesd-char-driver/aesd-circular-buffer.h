@@ -28,6 +28,11 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Number of bytes added to the buffer before this entry since it was initialized,
+     * maintained by aesd_circular_buffer_add_entry()
+     */
+    size_t cumulative_offs;
 };
 
 struct aesd_circular_buffer
@@ -36,6 +41,10 @@ struct aesd_circular_buffer
      * An array of pointers to memory allocated for the most recent write operations
      */
     struct aesd_buffer_entry *entry;
+    /**
+     * Number of elements of entry, set by aesd_circular_buffer_init()
+     */
+    uint8_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
@@ -49,6 +58,19 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Total number of bytes in the entries currently stored
+     */
+    size_t total_size;
+    /**
+     * Number of bytes added to the buffer since it was initialized, the cumulative_offs
+     * of the next entry
+     */
+    size_t written_size;
+    /**
+     * Number of entries added to the buffer since it was initialized
+     */
+    size_t written_count;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -56,8 +78,18 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern uint8_t aesd_circular_buffer_entry_count(const struct aesd_circular_buffer *buffer);
+
+extern uint8_t aesd_circular_buffer_entry_index_for_fpos(struct aesd_circular_buffer *buffer, size_t char_offset);
+
+extern bool aesd_circular_buffer_fpos_for_entry(const struct aesd_circular_buffer *buffer, uint32_t entry_index,
+            size_t entry_offset, size_t *char_offset_rtn);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer, uint8_t m_circular_buffer_size);
 
+extern int aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer, uint8_t new_size,
+            void (*free_buffptr)(const char *buffptr));
+
 extern void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer);
 /**
  * Create a for loop to iterate over each member of the circular buffer.
@@ -73,9 +105,9 @@ extern void aesd_circular_buffer_cleanup(struct aesd_circular_buffer *buffer);
  *      free(entry->buffptr);
  * }
  */
-#define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index,buffer_size) \
+#define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<buffer_size; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
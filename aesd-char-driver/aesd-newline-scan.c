@@ -0,0 +1,174 @@
+/**
+ * @file aesd-newline-scan.c
+ * @brief Newline scanning of the bytes written by the clients
+ *
+ * Every implementation builds a bit mask of the newline bytes in a block, one bit
+ * per byte, then turns the bits set into positions, so a block without newline
+ * costs a compare and a test whatever its size.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#endif
+
+#include "aesd-newline-scan.h"
+
+#define ONES_64 0x0101010101010101ULL
+
+/**
+ * Appends @param base plus the index of each bit set in @param mask to @param positions,
+ * with @param shift the log2 of the number of mask bits per byte.
+ * @return the new number of positions, at most @param max_positions
+ */
+static inline size_t add_positions(uint64_t mask, int shift, size_t base, size_t *positions,
+        size_t count, size_t max_positions)
+{
+    while (mask != 0 && count < max_positions)
+    {
+        positions[count++] = base + (__builtin_ctzll(mask) >> shift);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+/**
+ * Scans the @param len bytes at @param buf one at a time, the reference implementation
+ */
+size_t aesd_newline_scan_bytes(const char *buf, size_t len, size_t *positions, size_t max_positions)
+{
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < len && count < max_positions; i++)
+    {
+        if (buf[i] == '\n')
+            positions[count++] = i;
+    }
+    return count;
+}
+
+/**
+ * Scans the tail of a block based scan, from @param start
+ */
+static size_t scan_tail(const char *buf, size_t start, size_t len, size_t *positions,
+        size_t count, size_t max_positions)
+{
+    size_t found = aesd_newline_scan_bytes(buf + start, len - start, positions + count, max_positions - count);
+    size_t i;
+
+    for (i = count; i < count + found; i++)
+        positions[i] += start;
+    return count + found;
+}
+
+/**
+ * Scans 8 bytes at a time in general purpose registers, usable in the kernel where
+ * the vector registers are not available without saving the FPU state
+ */
+size_t aesd_newline_scan_words(const char *buf, size_t len, size_t *positions, size_t max_positions)
+{
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i + 8 <= len && count < max_positions; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        // Lowest bit for the first byte, as on little endian
+        word = __builtin_bswap64(word);
+#endif
+        // Zero bytes where the newlines were, then 0x80 in exactly those bytes
+        word ^= '\n' * ONES_64;
+        uint64_t mask = ~(((word & (0x7f * ONES_64)) + 0x7f * ONES_64) | word | 0x7f * ONES_64);
+        count = add_positions(mask, 3, i, positions, count, max_positions);
+    }
+    return count < max_positions ? scan_tail(buf, i, len, positions, count, max_positions) : count;
+}
+
+#ifdef AESD_NEWLINE_SCAN_X86
+/**
+ * Skips from @param i, the start of a block without newline, to the block starting
+ * at the next newline. The C library memchr() crosses long records faster than
+ * collecting empty masks.
+ * @return the start of the next block, @param len when there is no newline left
+ */
+static size_t skip_to_newline(const char *buf, size_t i, size_t len)
+{
+    const char *newline = memchr(buf + i, '\n', len - i);
+    return newline ? (size_t)(newline - buf) : len;
+}
+
+/**
+ * Scans 64 bytes at a time as four 16 byte vectors, SSE2 is part of the x86-64 baseline
+ */
+size_t aesd_newline_scan_sse2(const char *buf, size_t len, size_t *positions, size_t max_positions)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 64 <= len && count < max_positions)
+    {
+        uint64_t mask = 0;
+        int part;
+        for (part = 0; part < 4; part++)
+        {
+            __m128i block = _mm_loadu_si128((const __m128i *)(buf + i + part * 16));
+            mask |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)) << (part * 16);
+        }
+        if (mask == 0)
+        {
+            i = skip_to_newline(buf, i + 64, len);
+            continue;
+        }
+        count = add_positions(mask, 0, i, positions, count, max_positions);
+        i += 64;
+    }
+    return count < max_positions ? scan_tail(buf, i, len, positions, count, max_positions) : count;
+}
+
+/**
+ * Scans 64 bytes at a time as two 32 byte vectors, only called when the CPU supports AVX2
+ */
+__attribute__((target("avx2")))
+size_t aesd_newline_scan_avx2(const char *buf, size_t len, size_t *positions, size_t max_positions)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 64 <= len && count < max_positions)
+    {
+        __m256i low = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i high = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        uint64_t mask = (uint64_t)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(high, newline)) << 32 |
+                (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, newline));
+        if (mask == 0)
+        {
+            i = skip_to_newline(buf, i + 64, len);
+            continue;
+        }
+        count = add_positions(mask, 0, i, positions, count, max_positions);
+        i += 64;
+    }
+    return count < max_positions ? scan_tail(buf, i, len, positions, count, max_positions) : count;
+}
+#endif
+
+size_t aesd_newline_scan(const char *buf, size_t len, size_t *positions, size_t max_positions)
+{
+#ifdef AESD_NEWLINE_SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return aesd_newline_scan_avx2(buf, len, positions, max_positions);
+    return aesd_newline_scan_sse2(buf, len, positions, max_positions);
+#else
+    return aesd_newline_scan_words(buf, len, positions, max_positions);
+#endif
+}
@@ -0,0 +1,43 @@
+/*
+ * aesd-newline-scan.h
+ *
+ *  Finds the newline positions ending the records in a chunk of bytes.
+ *
+ *  Shared by the driver write path and aesdsocket framing. The kernel build scans
+ *  a word at a time, the user space build uses SSE2 or AVX2 when the CPU has them.
+ */
+
+#ifndef AESD_NEWLINE_SCAN_H
+#define AESD_NEWLINE_SCAN_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h> // size_t
+#endif
+
+/**
+ * Signature shared by the scanner implementations
+ */
+typedef size_t (*aesd_newline_scan_fn)(const char *buf, size_t len, size_t *positions, size_t max_positions);
+
+/**
+ * Stores in @param positions the offsets of the first newlines of the @param len bytes at @param buf,
+ * in increasing order, stopping after @param max_positions of them. A caller getting max_positions
+ * back scans again from the byte after the last position.
+ * @return the number of newlines stored
+ */
+size_t aesd_newline_scan(const char *buf, size_t len, size_t *positions, size_t max_positions);
+
+/**
+ * Implementations behind aesd_newline_scan(), exported for the tests and the benchmark
+ */
+size_t aesd_newline_scan_bytes(const char *buf, size_t len, size_t *positions, size_t max_positions);
+size_t aesd_newline_scan_words(const char *buf, size_t len, size_t *positions, size_t max_positions);
+#if !defined(__KERNEL__) && defined(__x86_64__)
+#define AESD_NEWLINE_SCAN_X86
+size_t aesd_newline_scan_sse2(const char *buf, size_t len, size_t *positions, size_t max_positions);
+size_t aesd_newline_scan_avx2(const char *buf, size_t len, size_t *positions, size_t max_positions);
+#endif
+
+#endif /* AESD_NEWLINE_SCAN_H */
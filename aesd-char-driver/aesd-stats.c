@@ -0,0 +1,103 @@
+/**
+ * @file aesd-stats.c
+ * @brief Per CPU statistics of the aesdchar devices, exposed in debugfs
+ *
+ */
+
+#include <linux/seq_file.h>
+#include <linux/cpumask.h>
+
+#include "aesd-stats.h"
+
+static struct dentry *aesd_stats_root;
+
+static const char * const stat_names[AESD_STAT_NR] = {
+    [AESD_STAT_BYTES_WRITTEN] = "bytes_written",
+    [AESD_STAT_RECORDS_WRITTEN] = "records_written",
+    [AESD_STAT_PARTIAL_WRITES] = "partial_writes",
+    [AESD_STAT_BYTES_READ] = "bytes_read",
+    [AESD_STAT_RECORDS_READ] = "records_read",
+    [AESD_STAT_EVICTIONS] = "evictions",
+    [AESD_STAT_LOCK_ACQUISITIONS] = "lock_acquisitions",
+    [AESD_STAT_LOCK_WAIT_NS] = "lock_wait_ns",
+};
+
+static const char * const op_names[AESD_OP_NR] = {
+    [AESD_OP_READ] = "read",
+    [AESD_OP_WRITE] = "write",
+    [AESD_OP_IOCTL] = "ioctl",
+};
+
+void aesd_stats_create_root(void)
+{
+    aesd_stats_root = debugfs_create_dir("aesdchar", NULL);
+}
+
+void aesd_stats_remove_root(void)
+{
+    debugfs_remove_recursive(aesd_stats_root);
+    aesd_stats_root = NULL;
+}
+
+static int stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats *stats = s->private;
+    int stat, cpu;
+
+    for (stat = 0; stat < AESD_STAT_NR; stat++) {
+        u64 sum = 0;
+
+        for_each_possible_cpu(cpu)
+            sum += per_cpu_ptr(stats->cpu, cpu)->counters[stat];
+        seq_printf(s, "%s %llu\n", stat_names[stat], sum);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/* One line per bucket, with its lower bound in ns then the count of each operation */
+static int latency_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats *stats = s->private;
+    int op, bucket, cpu;
+
+    seq_puts(s, "ns");
+    for (op = 0; op < AESD_OP_NR; op++)
+        seq_printf(s, " %s", op_names[op]);
+    seq_putc(s, '\n');
+
+    for (bucket = 0; bucket < AESD_LATENCY_BUCKETS; bucket++) {
+        seq_printf(s, "%llu", 1ULL << bucket);
+        for (op = 0; op < AESD_OP_NR; op++) {
+            u64 sum = 0;
+
+            for_each_possible_cpu(cpu)
+                sum += per_cpu_ptr(stats->cpu, cpu)->latency[op][bucket];
+            seq_printf(s, " %llu", sum);
+        }
+        seq_putc(s, '\n');
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+int aesd_stats_init(struct aesd_stats *stats, const char *name)
+{
+    stats->cpu = alloc_percpu(struct aesd_stats_cpu);
+    if (stats->cpu == NULL)
+        return -ENOMEM;
+
+    // debugfs is optional, failures are not reported
+    stats->dir = debugfs_create_dir(name, aesd_stats_root);
+    debugfs_create_file("stats", 0444, stats->dir, stats, &stats_fops);
+    debugfs_create_file("latency", 0444, stats->dir, stats, &latency_fops);
+    return 0;
+}
+
+void aesd_stats_cleanup(struct aesd_stats *stats)
+{
+    debugfs_remove_recursive(stats->dir);
+    stats->dir = NULL;
+    free_percpu(stats->cpu);
+    stats->cpu = NULL;
+}
@@ -0,0 +1,92 @@
+/*
+ * aesd-stats.h
+ *
+ *  Runtime statistics of an aesdchar device, kernel only.
+ *
+ *  Counters and latency histograms are kept per CPU so updating them never
+ *  contends, and are only summed when read from debugfs, in
+ *  /sys/kernel/debug/aesdchar/<device>/stats and latency.
+ */
+
+#ifndef AESD_STATS_H
+#define AESD_STATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+
+enum aesd_stat
+{
+    AESD_STAT_BYTES_WRITTEN,
+    AESD_STAT_RECORDS_WRITTEN,
+    AESD_STAT_PARTIAL_WRITES,
+    AESD_STAT_BYTES_READ,
+    AESD_STAT_RECORDS_READ,
+    AESD_STAT_EVICTIONS,
+    AESD_STAT_LOCK_ACQUISITIONS,
+    AESD_STAT_LOCK_WAIT_NS,
+    AESD_STAT_NR
+};
+
+enum aesd_op
+{
+    AESD_OP_READ,
+    AESD_OP_WRITE,
+    AESD_OP_IOCTL,
+    AESD_OP_NR
+};
+
+/**
+ * Latencies are counted in power of two buckets, bucket n holding [2^n, 2^(n+1)) ns
+ * and the last one everything longer
+ */
+#define AESD_LATENCY_BUCKETS 32
+
+struct aesd_stats_cpu
+{
+    u64 counters[AESD_STAT_NR];
+    u64 latency[AESD_OP_NR][AESD_LATENCY_BUCKETS];
+};
+
+struct aesd_stats
+{
+    struct aesd_stats_cpu __percpu *cpu;
+    struct dentry *dir;
+};
+
+/**
+ * Creates the debugfs directory holding the statistics of every device
+ */
+extern void aesd_stats_create_root(void);
+
+extern void aesd_stats_remove_root(void);
+
+/**
+ * Allocates the counters of @param stats and exposes them in debugfs as @param name
+ * @return 0 on success or -ENOMEM
+ */
+extern int aesd_stats_init(struct aesd_stats *stats, const char *name);
+
+extern void aesd_stats_cleanup(struct aesd_stats *stats);
+
+static inline void aesd_stats_add(struct aesd_stats *stats, enum aesd_stat stat, u64 value)
+{
+    this_cpu_add(stats->cpu->counters[stat], value);
+}
+
+/**
+ * Counts an operation @param op which started at @param start_ns, from ktime_get_ns()
+ */
+static inline void aesd_stats_op_done(struct aesd_stats *stats, enum aesd_op op, u64 start_ns)
+{
+    u64 ns = ktime_get_ns() - start_ns;
+    unsigned int bucket = ns ? ilog2(ns) : 0;
+
+    if (bucket >= AESD_LATENCY_BUCKETS)
+        bucket = AESD_LATENCY_BUCKETS - 1;
+    this_cpu_inc(stats->cpu->latency[op][bucket]);
+}
+
+#endif /* AESD_STATS_H */
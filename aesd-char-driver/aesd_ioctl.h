@@ -33,14 +33,95 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * One record of an AESDCHAR_IOCAPPEND batch
+ */
+struct aesd_record {
+    /**
+     * User space address of the record data
+     */
+    uint64_t data;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+/**
+ * A structure to be passed by IOCTL to append records to an aesdchar device, each record
+ * becoming a command on its own whether or not it ends with a newline
+ */
+struct aesd_append {
+    /**
+     * User space address of an array of count struct aesd_record
+     */
+    uint64_t records;
+    uint32_t count;
+    /**
+     * Set by the driver to the number of records stored, always the first ones of the array
+     */
+    uint32_t stored;
+};
+
+/**
+ * Records stored at most by one AESDCHAR_IOCAPPEND, so the device lock is not held for too long
+ */
+#define AESDCHAR_APPEND_MAX_RECORDS 1024
+
+/**
+ * Read cursor of an open aesdchar file, returned by AESDCHAR_IOCCURSOR
+ */
+struct aesd_cursor {
+    /**
+     * Sequence number of the next record to read, records are numbered from 0 as they are written
+     */
+    uint64_t record;
+    /**
+     * Number of records overwritten before this file could read them, since it was opened
+     */
+    uint64_t lost_records;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Append a batch of records under a single lock acquisition, returns the number of records stored
+#define AESDCHAR_IOCAPPEND _IOWR(AESD_IOC_MAGIC, 2, struct aesd_append)
+// Get the read cursor of the file and the number of records it lost to overwrites
+#define AESDCHAR_IOCCURSOR _IOR(AESD_IOC_MAGIC, 3, struct aesd_cursor)
+
+/**
+ * Layout of the first page mapped by mmap() on a device loaded with the ring_bytes parameter.
+ * The record index, an array of max_records stream offsets of record_start_size bytes, follows
+ * at index_offset and the byte ring at data_offset in the same mapping. Record n starts at
+ * index[n % max_records] and its bytes are at data[offset % data_size], see aesd-byte-ring.h.
+ */
+struct aesd_mmap_header {
+    /**
+     * Odd while the driver updates the ring. A reader copies the fields and the data it
+     * needs while it is even, then starts over if it changed meanwhile.
+     */
+    uint32_t sequence;
+    uint32_t record_start_size;
+    uint64_t index_offset;
+    uint64_t max_records;
+    uint64_t data_offset;
+    uint64_t data_size;
+    /**
+     * Number of the oldest record stored and of the next one to be written
+     */
+    uint64_t first_record;
+    uint64_t next_record;
+    /**
+     * Stream offsets of the oldest byte stored and of the next one to be written
+     */
+    uint64_t tail;
+    uint64_t head;
+};
+
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
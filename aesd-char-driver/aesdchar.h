@@ -9,8 +9,10 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd-byte-ring.h"
+#include "aesd-stats.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -31,11 +33,64 @@ struct aesd_dev
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
     struct aesd_circular_buffer circular_buffer;
-    char temp_buffer[1024];
-    size_t temp_buffer_size;
+    /**
+     * Used instead of circular_buffer when the ring_bytes module parameter is set
+     */
+    struct aesd_byte_ring byte_ring;
+    /**
+     * First page of the mmap() view of byte_ring
+     */
+    struct aesd_mmap_header *mmap_header;
+    /**
+     * Published on every update of circular_buffer, for readers not taking the lock
+     */
+    seqcount_mutex_t circular_buffer_seq;
+    /**
+     * Command being assembled until a newline is written, allocated with
+     * aesd_rcu_payload_realloc() so it can be added to circular_buffer as is
+     */
+    char *staging_buffer;
+    size_t staging_size;
+    size_t staging_capacity;
+    /**
+     * Memory of an overwritten entry kept for the next command
+     */
+    char *spare_payload;
     struct mutex lock;
+    /**
+     * Woken when a command is complete, for readers waiting at the end of the buffer
+     */
+    wait_queue_head_t wait_queue;
+    /**
+     * Counters and latency histograms, in debugfs
+     */
+    struct aesd_stats stats;
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * State of an open aesdchar file, in file->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    /**
+     * Read cursor, the stream offset of the next byte to read, counting all the bytes written to
+     * the device, and the sequence number of the record holding it. Reads resume there rather than
+     * at the file offset, which older records being overwritten shift, until the file offset is changed.
+     */
+    bool cursor_valid;
+    size_t cursor_stream_pos;
+    u64 cursor_record;
+    /**
+     * File offset matching the cursor when it was last updated
+     */
+    loff_t cursor_fpos;
+    /**
+     * Records overwritten before this file read them
+     */
+    u64 lost_records;
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -0,0 +1,251 @@
+/**
+ * @file circular-buffer-benchmark.c
+ * @brief User space micro-benchmarks of aesd-circular-buffer.c
+ *
+ * Measures, for each buffer depth:
+ *  - add_entry: aesd_circular_buffer_add_entry() into a full buffer, evicting on every call
+ *  - find_<distribution>: aesd_circular_buffer_find_entry_offset_for_fpos() with offsets drawn
+ *    uniformly, in the oldest entry, in the newest entry or sequentially through the buffer
+ *  - churn: wrapping the whole buffer, each new entry being looked up right after it is added
+ *
+ * Each result is printed on its own line as a JSON object, so runs can be compared by a script.
+ *
+ * Usage: circular-buffer-benchmark [-n operations] [-r repeats] [-d min_depth] [-D max_depth] [-s seed]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define MAX_ENTRY_SIZE 128
+#define MAX_DEPTH 32
+
+static size_t operations = 1 << 20;
+static int repeats = 5;
+static int min_depth = 1;
+static int max_depth = MAX_DEPTH;
+static unsigned int seed = 1;
+
+static char payload[MAX_ENTRY_SIZE];
+static size_t *entry_sizes;
+static size_t *offsets;
+
+// Accumulated from the results so the compiler can not drop the calls measured
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *benchmark, int depth, double best_ns, double total_ns)
+{
+    printf("{\"benchmark\":\"%s\",\"depth\":%d,\"operations\":%zu,\"repeats\":%d,"
+           "\"best_ns_per_op\":%.3f,\"mean_ns_per_op\":%.3f,\"mops_per_s\":%.3f}\n",
+           benchmark, depth, operations, repeats, best_ns / operations,
+           total_ns / repeats / operations, operations / best_ns * 1e3);
+}
+
+static void add_entry(struct aesd_circular_buffer *buffer, size_t size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = payload, .size = size };
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+// Fills @param buffer with depth entries of the pregenerated sizes
+static void fill(struct aesd_circular_buffer *buffer, int depth)
+{
+    int i;
+    memset(buffer, 0, sizeof(*buffer));
+    aesd_circular_buffer_init(buffer, depth);
+    for (i = 0; i < depth; i++)
+    {
+        add_entry(buffer, entry_sizes[i]);
+    }
+}
+
+static void bench_add_entry(int depth)
+{
+    struct aesd_circular_buffer buffer;
+    double best = 0, total = 0;
+    int r;
+
+    fill(&buffer, depth);
+    for (r = 0; r < repeats; r++)
+    {
+        double start = now_ns();
+        size_t i;
+        for (i = 0; i < operations; i++)
+        {
+            add_entry(&buffer, entry_sizes[i]);
+        }
+        double elapsed = now_ns() - start;
+        total += elapsed;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    sink += buffer.total_size;
+    aesd_circular_buffer_cleanup(&buffer);
+    report("add_entry", depth, best, total);
+}
+
+enum distribution { UNIFORM, OLDEST, NEWEST, SEQUENTIAL };
+static const char * const distribution_names[] = { "find_uniform", "find_oldest", "find_newest", "find_sequential" };
+
+static void generate_offsets(struct aesd_circular_buffer *buffer, int depth, enum distribution distribution)
+{
+    size_t oldest_size = buffer->entry[buffer->out_offs].size;
+    size_t newest_size = buffer->entry[(buffer->in_offs + depth - 1) % depth].size;
+    size_t i;
+
+    for (i = 0; i < operations; i++)
+    {
+        switch (distribution)
+        {
+        case UNIFORM:
+            offsets[i] = (size_t)rand() % buffer->total_size;
+            break;
+        case OLDEST:
+            offsets[i] = (size_t)rand() % oldest_size;
+            break;
+        case NEWEST:
+            offsets[i] = buffer->total_size - newest_size + (size_t)rand() % newest_size;
+            break;
+        case SEQUENTIAL:
+            offsets[i] = i % buffer->total_size;
+            break;
+        }
+    }
+}
+
+static void bench_find(int depth, enum distribution distribution)
+{
+    struct aesd_circular_buffer buffer;
+    double best = 0, total = 0;
+    int r;
+
+    fill(&buffer, depth);
+    generate_offsets(&buffer, depth, distribution);
+    for (r = 0; r < repeats; r++)
+    {
+        size_t checksum = 0;
+        double start = now_ns();
+        size_t i;
+        for (i = 0; i < operations; i++)
+        {
+            size_t entry_offset;
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i], &entry_offset);
+            checksum += entry->size + entry_offset;
+        }
+        double elapsed = now_ns() - start;
+        sink += checksum;
+        total += elapsed;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    aesd_circular_buffer_cleanup(&buffer);
+    report(distribution_names[distribution], depth, best, total);
+}
+
+static void bench_churn(int depth)
+{
+    struct aesd_circular_buffer buffer;
+    double best = 0, total = 0;
+    int r;
+
+    fill(&buffer, depth);
+    for (r = 0; r < repeats; r++)
+    {
+        size_t checksum = 0;
+        double start = now_ns();
+        size_t i;
+        for (i = 0; i < operations; i++)
+        {
+            size_t entry_offset;
+            add_entry(&buffer, entry_sizes[i]);
+            struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer,
+                    buffer.total_size - entry_sizes[i], &entry_offset);
+            checksum += entry->size;
+        }
+        double elapsed = now_ns() - start;
+        sink += checksum;
+        total += elapsed;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    aesd_circular_buffer_cleanup(&buffer);
+    report("churn", depth, best, total);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:d:D:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            operations = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'd':
+            min_depth = atoi(optarg);
+            break;
+        case 'D':
+            max_depth = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n operations] [-r repeats] [-d min_depth] [-D max_depth] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (operations < MAX_DEPTH || repeats < 1 || min_depth < 1 || max_depth > MAX_DEPTH || min_depth > max_depth)
+    {
+        fprintf(stderr, "Depths must be within 1-%d and operations at least %d\n", MAX_DEPTH, MAX_DEPTH);
+        return 1;
+    }
+
+    entry_sizes = malloc(operations * sizeof(*entry_sizes));
+    offsets = malloc(operations * sizeof(*offsets));
+    if (entry_sizes == NULL || offsets == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    // Sizes and offsets are drawn up front so the random number generator is not measured
+    srand(seed);
+    size_t i;
+    for (i = 0; i < operations; i++)
+    {
+        entry_sizes[i] = 1 + (size_t)rand() % MAX_ENTRY_SIZE;
+    }
+
+    int depth;
+    for (depth = min_depth; depth <= max_depth; depth++)
+    {
+        bench_add_entry(depth);
+        bench_find(depth, UNIFORM);
+        bench_find(depth, OLDEST);
+        bench_find(depth, NEWEST);
+        bench_find(depth, SEQUENTIAL);
+        bench_churn(depth);
+    }
+
+    free(entry_sizes);
+    free(offsets);
+    return 0;
+}
@@ -20,7 +20,17 @@
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/moduleparam.h> 
+#include <linux/seqlock.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 #include "aesdchar.h"
+#include "aesd-circular-buffer-rcu.h"
+#include "aesd-byte-ring.h"
+#include "aesd-stats.h"
+#include "aesd-newline-scan.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
@@ -28,10 +38,61 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Your Name Here"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+#define AESD_MAX_DEVICES 64
+
+/* Number of /dev/aesdchar<minor> devices, each with its own circular buffer and lock */
+static int nr_devices = 1;
+module_param(nr_devices, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of aesdchar devices (1-64)");
+
+struct aesd_dev *aesd_devices;
 
 static int circular_buffer_size_mod_param = AESDCHAR_DEFAULT_MAX_WRITE_OPERATIONS_SUPPORTED;
 
+/* Readers do not take aesd_dev.lock and run concurrently with writers */
+static bool lockless_read = false;
+module_param(lockless_read, bool, S_IRUGO);
+MODULE_PARM_DESC(lockless_read, "Read without taking the device lock");
+
+/* A reader at the end of the buffer sleeps until the next command instead of getting 0 */
+static bool blocking_read = false;
+module_param(blocking_read, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(blocking_read, "Block reads at the end of the buffer until a new command is written");
+
+/* Bound each device by bytes rather than commands, 0 keeps the circular buffer of commands */
+static unsigned int ring_bytes = 0;
+module_param(ring_bytes, uint, S_IRUGO);
+MODULE_PARM_DESC(ring_bytes, "Byte capacity of each device, rounded up to a power of two (0: circular_buffer_size commands)");
+
+/* Record index slots per byte of ring, so records down to this size use the whole ring */
+#define AESD_BYTE_RING_MIN_RECORD 16
+
+static bool aesd_device_ready = false;
+
+/**
+ * Resizes the circular buffer of every device to @param new_size commands, keeping the newest ones.
+ * Readers and writers of a device wait on its lock meanwhile, commands being written stay in their
+ * staging buffer and file offsets remain valid since the stream offsets do not change.
+ * @return 0 on success, -ENOMEM if an entry array could not be allocated, the devices resized
+ * before keeping their new size
+ */
+static int aesd_resize_devices(uint8_t new_size)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < nr_devices && ret == 0; i++) {
+        struct aesd_dev *dev = &aesd_devices[i];
+
+        mutex_lock(&dev->lock);
+        ret = aesd_circular_buffer_resize(&dev->circular_buffer, new_size, aesd_rcu_payload_put);
+        mutex_unlock(&dev->lock);
+        wake_up_interruptible(&dev->wait_queue);
+    }
+    if (ret == 0)
+        circular_buffer_size_mod_param = new_size;
+    return ret;
+}
+
 static int circular_buffer_size_set(const char *val, const struct kernel_param *kp)
 {
 	int n = 0, ret;
@@ -40,12 +101,19 @@ static int circular_buffer_size_set(const char *val, const struct kernel_param *
 	if (ret != 0 || n < 1 || n > 32)
 		return -EINVAL;
 
-    ret = param_set_int(val, kp);
+	/* The devices do not exist yet when the parameter is given at load time */
+	if (!aesd_device_ready)
+		return param_set_int(val, kp);
+
+	/* Lockless readers may be walking the entry array, it can not be reallocated under them */
+	if (lockless_read)
+		return -EBUSY;
 
-    aesd_circular_buffer_init(&aesd_device.circular_buffer, circular_buffer_size_mod_param);
-    memset(aesd_device.temp_buffer, 0, sizeof(aesd_device.temp_buffer));
-    aesd_device.temp_buffer_size = 0;
-	return ret;
+	/* The command count does not apply to devices bounded by bytes */
+	if (ring_bytes)
+		return -EBUSY;
+
+	return aesd_resize_devices(n);
 }
 
 static const struct kernel_param_ops param_ops = {
@@ -55,13 +123,35 @@ static const struct kernel_param_ops param_ops = {
 
 module_param_cb(circular_buffer_size, &param_ops, &circular_buffer_size_mod_param, S_IRUGO|S_IWUSR);
 
+static int payload_stats_get(char *buffer, const struct kernel_param *kp)
+{
+    struct aesd_rcu_payload_stats stats;
+
+    aesd_rcu_payload_stats(&stats);
+    return scnprintf(buffer, PAGE_SIZE, "cache_allocs %ld\nkmalloc_allocs %ld\nrecycled %ld\nfrees %ld\n",
+            stats.cache_allocs, stats.kmalloc_allocs, stats.recycled, stats.frees);
+}
+
+static const struct kernel_param_ops payload_stats_ops = {
+	.get	= payload_stats_get,
+};
+
+/* Read only allocation counters of the circular buffer entries */
+module_param_cb(payload_stats, &payload_stats_ops, NULL, S_IRUGO);
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file;
+
     PDEBUG("open");
     /**
      * TODO: handle open
      */
-    filp->private_data = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    if (file == NULL)
+        return -ENOMEM;
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = file;
     return 0;
 }
 
@@ -71,151 +161,659 @@ int aesd_release(struct inode *inode, struct file *filp)
     /**
      * TODO: handle release
      */
+    kfree(filp->private_data);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+/* Takes the device lock, accounting for the time spent waiting for it */
+static void aesd_lock(struct aesd_dev *dev)
+{
+    u64 start = ktime_get_ns();
+
+    mutex_lock(&dev->lock);
+    aesd_stats_add(&dev->stats, AESD_STAT_LOCK_ACQUISITIONS, 1);
+    aesd_stats_add(&dev->stats, AESD_STAT_LOCK_WAIT_NS, ktime_get_ns() - start);
+}
+
+/* Stream offset of the oldest byte stored, file offsets count from there */
+static size_t aesd_stream_base(struct aesd_dev *dev)
+{
+    if (ring_bytes)
+        return dev->byte_ring.tail;
+    return dev->circular_buffer.written_size - dev->circular_buffer.total_size;
+}
+
+/* Stream offset of the next byte to be written, read without the lock by waiting readers */
+static size_t aesd_stream_end(struct aesd_dev *dev)
+{
+    if (ring_bytes)
+        return READ_ONCE(dev->byte_ring.head);
+    return READ_ONCE(dev->circular_buffer.written_size);
+}
+
+static size_t aesd_total_size(struct aesd_dev *dev)
+{
+    return ring_bytes ? aesd_byte_ring_total_size(&dev->byte_ring) : dev->circular_buffer.total_size;
+}
+
+/* Sequence number of the oldest record stored, records are numbered as they are written */
+static u64 aesd_first_record(struct aesd_dev *dev)
+{
+    if (ring_bytes)
+        return dev->byte_ring.first_record;
+    return dev->circular_buffer.written_count - aesd_circular_buffer_entry_count(&dev->circular_buffer);
+}
+
+/* Sequence number of the record holding the byte at @param stream_pos, which must be stored or the end */
+static u64 aesd_record_at(struct aesd_dev *dev, size_t stream_pos)
+{
+    size_t char_offset = stream_pos - aesd_stream_base(dev);
+
+    if (ring_bytes)
+        return aesd_first_record(dev) + aesd_byte_ring_record_index(&dev->byte_ring, char_offset);
+    return aesd_first_record(dev) + aesd_circular_buffer_entry_index_for_fpos(&dev->circular_buffer, char_offset);
+}
+
+/**
+ * Moves the cursor of @param file to @param stream_pos and sets @param f_pos to the matching file offset.
+ * Must be called with the device lock held.
+ */
+static void aesd_cursor_set(struct aesd_file *file, size_t stream_pos, loff_t *f_pos)
+{
+    struct aesd_dev *dev = file->dev;
+    size_t base = aesd_stream_base(dev);
+
+    /* A lockless read may end in a record evicted meanwhile, aesd_cursor_sync() then counts it as lost */
+    if (stream_pos >= base)
+        file->cursor_record = aesd_record_at(dev, stream_pos);
+    file->cursor_stream_pos = stream_pos;
+    file->cursor_valid = true;
+    *f_pos = stream_pos > base ? stream_pos - base : 0;
+    file->cursor_fpos = *f_pos;
+}
+
+/**
+ * Brings the cursor of @param file up to date before a read at @param f_pos, skipping and counting
+ * the records overwritten since the last read. Must be called with the device lock held.
+ */
+static void aesd_cursor_sync(struct aesd_file *file, loff_t *f_pos)
+{
+    struct aesd_dev *dev = file->dev;
+    size_t base = aesd_stream_base(dev);
+    u64 first_record;
+
+    if (!file->cursor_valid || *f_pos != file->cursor_fpos || file->cursor_stream_pos > aesd_stream_end(dev)) {
+        /* First read, the file offset was changed or the buffer was reset, start at the file offset */
+        aesd_cursor_set(file, base + min_t(size_t, *f_pos, aesd_total_size(dev)), f_pos);
+    } else if (file->cursor_stream_pos < base) {
+        first_record = aesd_first_record(dev);
+        if (first_record > file->cursor_record)
+            file->lost_records += first_record - file->cursor_record;
+        aesd_cursor_set(file, base, f_pos);
+    } else {
+        /* Records evicted since the last read moved the file offset of the cursor */
+        aesd_cursor_set(file, file->cursor_stream_pos, f_pos);
+    }
+}
+
+static ssize_t aesd_read_lockless(struct aesd_dev *p_aesd_dev, char __user *buf, size_t count,
+                size_t *stream_pos)
+{
+    size_t entry_offset_byte_rtn = 0;
+    size_t entry_size = 0;
+    size_t kernel_data_size;
+    size_t copied = 0;
+    const char *buffptr;
+
+    /* Fill the user buffer across consecutive entries, pinning one entry at a time */
+    while (copied < count) {
+        buffptr = aesd_circular_buffer_rcu_find_get(&p_aesd_dev->circular_buffer, &p_aesd_dev->circular_buffer_seq,
+                *stream_pos, &entry_offset_byte_rtn, &entry_size);
+        if (buffptr == NULL)
+            break;
+
+        kernel_data_size = entry_size - entry_offset_byte_rtn;
+        if (kernel_data_size > count - copied)
+            kernel_data_size = count - copied;
+        if (copy_to_user(buf + copied, buffptr + entry_offset_byte_rtn, kernel_data_size) != 0) {
+            aesd_rcu_payload_put(buffptr);
+            return copied ? (ssize_t)copied : -EFAULT;
+        }
+        aesd_rcu_payload_put(buffptr);
+
+        *stream_pos += kernel_data_size;
+        copied += kernel_data_size;
+    }
+    return copied;
+}
+
+/* Must be called with the device lock held */
+static ssize_t aesd_read_byte_ring(struct aesd_dev *p_aesd_dev, char __user *buf, size_t count,
+                size_t *stream_pos)
+{
+    const char *kernel_data;
+    size_t kernel_data_size;
+    size_t copied = 0;
+
+    /* Records are contiguous in the ring, each copy spans as many of them as fit until the wrap */
+    while (copied < count) {
+        kernel_data_size = aesd_byte_ring_peek(&p_aesd_dev->byte_ring, *stream_pos - p_aesd_dev->byte_ring.tail,
+                &kernel_data);
+        if (kernel_data_size == 0)
+            break;
+        if (kernel_data_size > count - copied)
+            kernel_data_size = count - copied;
+        if (copy_to_user(buf + copied, kernel_data, kernel_data_size) != 0) {
+            PDEBUG("Error copying data to user space\n");
+            return copied ? (ssize_t)copied : -EFAULT;
+        }
+        *stream_pos += kernel_data_size;
+        copied += kernel_data_size;
+    }
+    return copied;
+}
+
+/* Must be called with the device lock held */
+static ssize_t aesd_read_entries(struct aesd_dev *p_aesd_dev, char __user *buf, size_t count,
+                size_t *stream_pos)
 {
     ssize_t retval = 0;
-    struct aesd_dev *p_aesd_dev = filp->private_data;
     struct aesd_buffer_entry *p_aesd_buffer_entry = NULL;
     size_t entry_offset_byte_rtn = 0;
+    size_t base = aesd_stream_base(p_aesd_dev);
+
+    /* Walk consecutive entries until count is filled */
+    while ((size_t)retval < count) {
+        p_aesd_buffer_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&p_aesd_dev->circular_buffer,
+                *stream_pos - base, &entry_offset_byte_rtn);
+        if (p_aesd_buffer_entry == NULL)
+            break;
+        void *kernel_data = (void*)(p_aesd_buffer_entry->buffptr + entry_offset_byte_rtn);
+        size_t kernel_data_size = p_aesd_buffer_entry->size - entry_offset_byte_rtn;
+        if (kernel_data_size > count - (size_t)retval)
+            kernel_data_size = count - retval;
+        if (copy_to_user(buf + retval, kernel_data, kernel_data_size) != 0) {
+            PDEBUG("Error copying data to user space\n");
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+        *stream_pos += kernel_data_size;
+        retval += kernel_data_size;
+    }
+    return retval;
+}
+
+static ssize_t aesd_do_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    ssize_t retval = 0;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+    size_t stream_pos;
+    u64 cursor_record;
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
     /**
      * TODO: handle read
      */
-    if (p_aesd_dev == NULL) {
-        mutex_unlock(&p_aesd_dev->lock);
-        return -1;
-    }
-    mutex_lock(&p_aesd_dev->lock);
-    p_aesd_buffer_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&p_aesd_dev->circular_buffer, *f_pos, &entry_offset_byte_rtn);
-    if (p_aesd_buffer_entry == NULL) {
-        mutex_unlock(&p_aesd_dev->lock);
+    if (count == 0)
         return 0;
-    }
-    void *kernel_data = (void*)(p_aesd_buffer_entry->buffptr + entry_offset_byte_rtn);
-    size_t kernel_data_size = p_aesd_buffer_entry->size - entry_offset_byte_rtn;
-    if (kernel_data_size > count)
-        kernel_data_size = count;
-    if (copy_to_user(buf, kernel_data, kernel_data_size) != 0) {
-        PDEBUG("Error copying data to user space\n");
+
+    while (1) {
+        /* Reads start at the cursor of the file, so writes in between do not shift what is read */
+        aesd_lock(p_aesd_dev);
+        aesd_cursor_sync(file, f_pos);
+        stream_pos = file->cursor_stream_pos;
+        if (ring_bytes)
+            retval = aesd_read_byte_ring(p_aesd_dev, buf, count, &stream_pos);
+        else if (!lockless_read)
+            retval = aesd_read_entries(p_aesd_dev, buf, count, &stream_pos);
         mutex_unlock(&p_aesd_dev->lock);
-        return -1;
+
+        if (!ring_bytes && lockless_read)
+            retval = aesd_read_lockless(p_aesd_dev, buf, count, &stream_pos);
+
+        if (retval > 0) {
+            aesd_lock(p_aesd_dev);
+            cursor_record = file->cursor_record;
+            aesd_cursor_set(file, stream_pos, f_pos);
+            aesd_stats_add(&p_aesd_dev->stats, AESD_STAT_RECORDS_READ, file->cursor_record - cursor_record);
+            mutex_unlock(&p_aesd_dev->lock);
+            aesd_stats_add(&p_aesd_dev->stats, AESD_STAT_BYTES_READ, retval);
+        }
+        if (retval != 0 || !blocking_read)
+            return retval;
+
+        if (filp->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        PDEBUG("read waiting for a new command\n");
+        if (wait_event_interruptible(p_aesd_dev->wait_queue,
+                    aesd_stream_end(p_aesd_dev) != file->cursor_stream_pos))
+            return -ERESTARTSYS;
     }
-    *f_pos = *f_pos + kernel_data_size;
-    //*f_pos = *f_pos + kernel_data_size + 1;
-    retval = kernel_data_size;
-    mutex_unlock(&p_aesd_dev->lock);
+}
+
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
+                loff_t *f_pos)
+{
+    struct aesd_dev *p_aesd_dev = ((struct aesd_file *)filp->private_data)->dev;
+    u64 start = ktime_get_ns();
+    ssize_t retval = aesd_do_read(filp, buf, count, f_pos);
+
+    aesd_stats_op_done(&p_aesd_dev->stats, AESD_OP_READ, start);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+/* Seqlock style update of the mmap header, mapped readers retry when the sequence changed */
+static void aesd_mmap_update_begin(struct aesd_dev *dev)
+{
+    WRITE_ONCE(dev->mmap_header->sequence, dev->mmap_header->sequence + 1);
+    smp_wmb();
+}
+
+static void aesd_mmap_update_end(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    const struct aesd_byte_ring *ring = &dev->byte_ring;
+
+    WRITE_ONCE(header->first_record, ring->first_record);
+    WRITE_ONCE(header->next_record, ring->next_record);
+    WRITE_ONCE(header->tail, ring->tail);
+    WRITE_ONCE(header->head, ring->head);
+    smp_wmb();
+    WRITE_ONCE(header->sequence, header->sequence + 1);
+}
+
+static int aesd_mmap_init(struct aesd_dev *dev)
+{
+    const struct aesd_byte_ring *ring = &dev->byte_ring;
+
+    dev->mmap_header = vmalloc_user(PAGE_SIZE);
+    if (dev->mmap_header == NULL)
+        return -ENOMEM;
+    dev->mmap_header->record_start_size = sizeof(*ring->record_start);
+    dev->mmap_header->index_offset = PAGE_SIZE;
+    dev->mmap_header->max_records = ring->max_records;
+    dev->mmap_header->data_offset = PAGE_SIZE + PAGE_ALIGN(ring->max_records * sizeof(*ring->record_start));
+    dev->mmap_header->data_size = ring->data_size;
+    return 0;
+}
+
+/* Keeps the memory of an overwritten entry for the next command, see aesd_circular_buffer_rcu_add_entry() */
+static void aesd_keep_spare_payload(struct aesd_dev *dev, char *recycled)
+{
+    if (dev->spare_payload == NULL)
+        dev->spare_payload = recycled;
+    else
+        aesd_rcu_payload_put(recycled);
+}
+
+/* Payload for a new entry of @param size bytes, the spare one when it is large enough */
+static char *aesd_get_payload(struct aesd_dev *dev, size_t size)
+{
+    char *payload;
+
+    if (dev->spare_payload != NULL && size <= AESD_RCU_PAYLOAD_CACHE_SIZE) {
+        payload = dev->spare_payload;
+        dev->spare_payload = NULL;
+        return payload;
+    }
+    return aesd_rcu_payload_alloc(size, GFP_KERNEL);
+}
+
+/* Counts a command of @param size bytes just added, when the oldest record was @param first_record before */
+static void aesd_count_command(struct aesd_dev *dev, u64 first_record, size_t size)
+{
+    aesd_stats_add(&dev->stats, AESD_STAT_RECORDS_WRITTEN, 1);
+    aesd_stats_add(&dev->stats, AESD_STAT_BYTES_WRITTEN, size);
+    aesd_stats_add(&dev->stats, AESD_STAT_EVICTIONS, aesd_first_record(dev) - first_record);
+}
+
+/* Adds @param payload, owned by the caller until now, as a new entry. Must be called with the lock held. */
+static void aesd_add_payload_locked(struct aesd_dev *dev, char *payload, size_t size)
+{
+    struct aesd_buffer_entry add_entry = {0};
+    u64 first_record = aesd_first_record(dev);
+
+    add_entry.buffptr = payload;
+    add_entry.size = size;
+    aesd_keep_spare_payload(dev, aesd_circular_buffer_rcu_add_entry(&dev->circular_buffer,
+                &dev->circular_buffer_seq, &add_entry));
+    aesd_count_command(dev, first_record, size);
+}
+
+/**
+ * Adds a complete command of @param size bytes copied from @param data, in kernel space,
+ * or from @param user_data when data is NULL. Must be called with the lock held.
+ * @return 0 on success or a negative error code
+ */
+static int aesd_add_command_locked(struct aesd_dev *dev, const char *data, const char __user *user_data,
+                size_t size)
+{
+    char *dest;
+    size_t first_part;
+    u64 first_record = aesd_first_record(dev);
+    int err;
+
+    if (ring_bytes) {
+        aesd_mmap_update_begin(dev);
+        err = aesd_byte_ring_reserve(&dev->byte_ring, size, &dest, &first_part);
+        if (!err && data != NULL) {
+            memcpy(dest, data, first_part);
+            memcpy(dev->byte_ring.data, data + first_part, size - first_part);
+        } else if (!err) {
+            if (copy_from_user(dest, user_data, first_part) != 0 ||
+                    copy_from_user(dev->byte_ring.data, user_data + first_part, size - first_part) != 0)
+                err = -EFAULT;
+        }
+        if (!err) {
+            aesd_byte_ring_commit(&dev->byte_ring, size);
+            aesd_count_command(dev, first_record, size);
+        }
+        aesd_mmap_update_end(dev);
+        return err;
+    }
+
+    dest = aesd_get_payload(dev, size);
+    if (dest == NULL)
+        return -ENOMEM;
+    if (data != NULL) {
+        memcpy(dest, data, size);
+    } else if (copy_from_user(dest, user_data, size) != 0) {
+        aesd_keep_spare_payload(dev, dest);
+        return -EFAULT;
+    }
+    aesd_add_payload_locked(dev, dest, size);
+    return 0;
+}
+
+/* Makes room for @param count more bytes in the staging buffer. Must be called with the lock held. */
+static int aesd_grow_staging_locked(struct aesd_dev *p_aesd_dev, size_t count)
+{
+    /* Start a new command in the memory of the last overwritten entry if there is one */
+    if (p_aesd_dev->staging_buffer == NULL && p_aesd_dev->spare_payload != NULL) {
+        p_aesd_dev->staging_buffer = p_aesd_dev->spare_payload;
+        p_aesd_dev->staging_capacity = AESD_RCU_PAYLOAD_CACHE_SIZE;
+        p_aesd_dev->spare_payload = NULL;
+    }
+
+    /* Grow the staging buffer, small commands come from the payload slab cache */
+    size_t needed = p_aesd_dev->staging_size + count;
+    if (needed > p_aesd_dev->staging_capacity) {
+        size_t new_capacity = max(needed, p_aesd_dev->staging_capacity * 2);
+        char *new_buffer = aesd_rcu_payload_realloc(p_aesd_dev->staging_buffer, new_capacity, GFP_KERNEL);
+        if (new_buffer == NULL)
+            return -ENOMEM;
+        p_aesd_dev->staging_buffer = new_buffer;
+        p_aesd_dev->staging_capacity = new_capacity;
+    }
+    return 0;
+}
+
+/* Adds the command assembled in the staging buffer. Must be called with the lock held. */
+static int aesd_commit_staging_locked(struct aesd_dev *p_aesd_dev)
+{
+    int err = 0;
+
+    PDEBUG("Complete write of %zu bytes\n", p_aesd_dev->staging_size);
+    if (ring_bytes) {
+        /* The command is copied into the ring, the staging buffer is kept for the next one */
+        err = aesd_add_command_locked(p_aesd_dev, p_aesd_dev->staging_buffer, NULL, p_aesd_dev->staging_size);
+        p_aesd_dev->staging_size = 0;
+        return err;
+    }
+
+    /* The staging buffer becomes the circular buffer entry */
+    aesd_add_payload_locked(p_aesd_dev, p_aesd_dev->staging_buffer, p_aesd_dev->staging_size);
+    p_aesd_dev->staging_buffer = NULL;
+    p_aesd_dev->staging_size = 0;
+    p_aesd_dev->staging_capacity = 0;
+    return err;
+}
+
+static ssize_t aesd_do_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
-    struct aesd_dev *p_aesd_dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
     /**
      * TODO: handle write
      */
+    if (count == 0)
+        return 0;
+
+    aesd_lock(p_aesd_dev);
 
-    mutex_lock(&p_aesd_dev->lock);
-    void *new_buffer = kmalloc(count, GFP_KERNEL);
-    if (new_buffer == NULL) {
+    if (aesd_grow_staging_locked(p_aesd_dev, count) != 0) {
         mutex_unlock(&p_aesd_dev->lock);
         return retval;
     }
-    if (copy_from_user(new_buffer, buf, count) != 0) {
+
+    /* The only copy of the data, the staging buffer becomes the circular buffer entry */
+    if (copy_from_user(p_aesd_dev->staging_buffer + p_aesd_dev->staging_size, buf, count) != 0) {
         PDEBUG("Error copying data to kernel space\n");
         mutex_unlock(&p_aesd_dev->lock);
-        return -1;
+        return -EFAULT;
     }
+    p_aesd_dev->staging_size += count;
 
-    if (p_aesd_dev->temp_buffer_size + count < sizeof(p_aesd_dev->temp_buffer)) {
-        memcpy(p_aesd_dev->temp_buffer + p_aesd_dev->temp_buffer_size, new_buffer, count);
-        p_aesd_dev->temp_buffer_size += count;
-
-        if (p_aesd_dev->temp_buffer[p_aesd_dev->temp_buffer_size - 1] == '\n') {
-            PDEBUG("Complete write: %s\n", p_aesd_dev->temp_buffer);
-
-            memcpy(new_buffer, p_aesd_dev->temp_buffer, p_aesd_dev->temp_buffer_size);
-            struct aesd_buffer_entry add_entry = {0};
-            add_entry.buffptr = (char*)new_buffer;
-            add_entry.size = p_aesd_dev->temp_buffer_size;
-            const char* pointer_to_free = aesd_circular_buffer_add_entry(&p_aesd_dev->circular_buffer, &add_entry);
-            if (!pointer_to_free)
-                kfree(pointer_to_free);
-
-            memset(p_aesd_dev->temp_buffer, 0, sizeof(p_aesd_dev->temp_buffer));
-            p_aesd_dev->temp_buffer_size = 0;
-        } else {
-            PDEBUG("Partial write without newline, waiting for more data\n");
-        }
-        retval = count;
+    retval = count;
+    bool complete = p_aesd_dev->staging_buffer[p_aesd_dev->staging_size - 1] == '\n';
+    if (complete) {
+        int err = aesd_commit_staging_locked(p_aesd_dev);
+        if (err)
+            retval = err;
     } else {
-        PDEBUG("Buffer overflow\n");
+        PDEBUG("Partial write without newline, waiting for more data\n");
+        aesd_stats_add(&p_aesd_dev->stats, AESD_STAT_PARTIAL_WRITES, 1);
     }
     mutex_unlock(&p_aesd_dev->lock);
+    if (complete)
+        wake_up_interruptible(&p_aesd_dev->wait_queue);
     return retval;
 }
 
-loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
+ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
+                loff_t *f_pos)
 {
-    struct aesd_dev *p_aesd_dev = filp->private_data;
+    struct aesd_dev *p_aesd_dev = ((struct aesd_file *)filp->private_data)->dev;
+    u64 start = ktime_get_ns();
+    ssize_t retval = aesd_do_write(filp, buf, count, f_pos);
 
-    /* Get buffer size */
-    loff_t buffer_size = 0;
-    int i = 0;
-    for (i = 0; i<circular_buffer_size_mod_param; i++)
-    {
-        buffer_size =  buffer_size + p_aesd_dev->circular_buffer.entry[i].size;
-    }
-    return fixed_size_llseek(filp, offset, whence, buffer_size);
+    aesd_stats_op_done(&p_aesd_dev->stats, AESD_OP_WRITE, start);
+    return retval;
 }
 
-static long aesd_adjust_file_offset (struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
+/**
+ * writev() support, each newline ends a command rather than only a trailing one like in aesd_write(),
+ * so a vector of lines is stored as one command per line with a single lock acquisition
+ */
+static ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct aesd_dev *p_aesd_dev = filp->private_data;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+    size_t count = iov_iter_count(from);
+    size_t start, old_size, scan, found, i;
+    size_t positions[16];
+    u64 start_ns = ktime_get_ns();
+    bool complete = false;
+    bool committed = false;
+    int err = 0;
 
-    /* Check write_cmd validity */
-    int no_of_cmds = 0;
-    for (no_of_cmds = 0; no_of_cmds<circular_buffer_size_mod_param; no_of_cmds++)
-    {
-        if (p_aesd_dev->circular_buffer.entry[no_of_cmds].size == 0)
+    PDEBUG("write_iter %zu bytes", count);
+    if (count == 0)
+        return 0;
+
+    aesd_lock(p_aesd_dev);
+
+    if (aesd_grow_staging_locked(p_aesd_dev, count) != 0) {
+        mutex_unlock(&p_aesd_dev->lock);
+        return -ENOMEM;
+    }
+    old_size = p_aesd_dev->staging_size;
+    if (copy_from_iter(p_aesd_dev->staging_buffer + old_size, count, from) != count) {
+        mutex_unlock(&p_aesd_dev->lock);
+        return -EFAULT;
+    }
+    p_aesd_dev->staging_size += count;
+
+    /* Lines are copied out as separate commands, the pending partial command before old_size has none */
+    start = 0;
+    scan = old_size;
+    while (!err && !committed) {
+        found = aesd_newline_scan(p_aesd_dev->staging_buffer + scan, p_aesd_dev->staging_size - scan,
+                                  positions, ARRAY_SIZE(positions));
+        if (found == 0)
             break;
+        for (i = 0; i < found && !err; i++) {
+            size_t len = scan + positions[i] + 1 - start;
+
+            complete = true;
+            if (start == 0 && len == p_aesd_dev->staging_size) {
+                /* A single command, hand over the staging buffer itself */
+                err = aesd_commit_staging_locked(p_aesd_dev);
+                committed = true;
+                break;
+            }
+            err = aesd_add_command_locked(p_aesd_dev, p_aesd_dev->staging_buffer + start, NULL, len);
+            start += len;
+        }
+        scan = start;
     }
-    if (no_of_cmds < write_cmd)
-    {
-        PDEBUG("Number of command does not exist\n");
-        return -EINVAL;
+    if (start > 0) {
+        /* Keep the partial command following the last newline */
+        memmove(p_aesd_dev->staging_buffer, p_aesd_dev->staging_buffer + start, p_aesd_dev->staging_size - start);
+        p_aesd_dev->staging_size -= start;
     }
+    if (p_aesd_dev->staging_size > 0)
+        aesd_stats_add(&p_aesd_dev->stats, AESD_STAT_PARTIAL_WRITES, 1);
+
+    mutex_unlock(&p_aesd_dev->lock);
+    if (complete)
+        wake_up_interruptible(&p_aesd_dev->wait_queue);
+    aesd_stats_op_done(&p_aesd_dev->stats, AESD_OP_WRITE, start_ns);
+    return err ? err : (ssize_t)count;
+}
+
+/* Always writable, readable when data was written past the read cursor */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+    bool readable;
+
+    poll_wait(filp, &p_aesd_dev->wait_queue, wait);
+
+    aesd_lock(p_aesd_dev);
+    if (file->cursor_valid && filp->f_pos == file->cursor_fpos)
+        readable = file->cursor_stream_pos != aesd_stream_end(p_aesd_dev);
+    else
+        readable = filp->f_pos < (loff_t)aesd_total_size(p_aesd_dev);
+    mutex_unlock(&p_aesd_dev->lock);
+    if (readable)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+
+    /* Get buffer size, maintained by the circular buffer on each write */
+    aesd_lock(p_aesd_dev);
+    loff_t buffer_size = aesd_total_size(p_aesd_dev);
+    file->cursor_valid = false;
+    mutex_unlock(&p_aesd_dev->lock);
+
+    return fixed_size_llseek(filp, offset, whence, buffer_size);
+}
+
+static long aesd_adjust_file_offset (struct file *filp, unsigned int write_cmd, unsigned int write_cmd_offset)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+    size_t cmd_offset = 0;
+    bool found;
 
-    /* Check write_cmd_offset validity */
-    if (p_aesd_dev->circular_buffer.entry[write_cmd].size < write_cmd_offset)
+    /* Check write_cmd and write_cmd_offset validity and get the offset from the cumulative sizes */
+    aesd_lock(p_aesd_dev);
+    if (ring_bytes)
+        found = aesd_byte_ring_fpos_for_record(&p_aesd_dev->byte_ring, write_cmd, write_cmd_offset, &cmd_offset);
+    else
+        found = aesd_circular_buffer_fpos_for_entry(&p_aesd_dev->circular_buffer, write_cmd, write_cmd_offset, &cmd_offset);
+    if (!found)
     {
-        PDEBUG("Offset of command is to big\n");
+        mutex_unlock(&p_aesd_dev->lock);
+        PDEBUG("Number or offset of command does not exist\n");
         return -EINVAL;
     }
-    
-    int i = 0;
-    int cmd_offset = 0;
-    for (i = 0; i<(write_cmd); i++)
-    {
-        cmd_offset = cmd_offset + p_aesd_dev->circular_buffer.entry[i].size;
-    }
+    file->cursor_valid = false;
+    mutex_unlock(&p_aesd_dev->lock);
 
-    long return_value = cmd_offset + write_cmd_offset;
+    long return_value = cmd_offset;
     filp->f_pos = return_value;
     return return_value;
 }
 
-long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+/* Adds the records of @param append as separate commands with one lock acquisition */
+static long aesd_append_records(struct file *filp, struct aesd_append *append)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+    const struct aesd_record __user *records = u64_to_user_ptr(append->records);
+    struct aesd_record record;
+    uint32_t count = min_t(uint32_t, append->count, AESDCHAR_APPEND_MAX_RECORDS);
+    uint32_t stored;
+    int err = 0;
+
+    aesd_lock(p_aesd_dev);
+    for (stored = 0; stored < count; stored++) {
+        if (copy_from_user(&record, &records[stored], sizeof(record)) != 0) {
+            err = -EFAULT;
+            break;
+        }
+        if (record.size == 0) {
+            err = -EINVAL;
+            break;
+        }
+        err = aesd_add_command_locked(p_aesd_dev, NULL, u64_to_user_ptr(record.data), record.size);
+        if (err)
+            break;
+    }
+    mutex_unlock(&p_aesd_dev->lock);
+
+    PDEBUG("Appended %u of %u records\n", stored, append->count);
+    append->stored = stored;
+    if (stored == 0)
+        return err;
+    wake_up_interruptible(&p_aesd_dev->wait_queue);
+    return stored;
+}
+
+/* Reports the read cursor of @param filp in @param cursor */
+static void aesd_get_cursor(struct file *filp, struct aesd_cursor *cursor)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *p_aesd_dev = file->dev;
+
+    aesd_lock(p_aesd_dev);
+    aesd_cursor_sync(file, &filp->f_pos);
+    cursor->record = file->cursor_record;
+    cursor->lost_records = file->lost_records;
+    mutex_unlock(&p_aesd_dev->lock);
+}
+
+static long aesd_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     long retval = -EINVAL;
     struct aesd_seekto seekto;
+    struct aesd_append append;
+    struct aesd_cursor cursor;
     switch (cmd) {
         case AESDCHAR_IOCSEEKTO:
             if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0)
@@ -228,6 +826,27 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             }
             break;
 
+        case AESDCHAR_IOCAPPEND:
+            if (copy_from_user(&append, (const void __user *)arg, sizeof(append)) != 0)
+            {
+                return -EFAULT;
+            }
+            retval = aesd_append_records(filp, &append);
+            if (copy_to_user((void __user *)arg, &append, sizeof(append)) != 0)
+            {
+                return -EFAULT;
+            }
+            break;
+
+        case AESDCHAR_IOCCURSOR:
+            aesd_get_cursor(filp, &cursor);
+            if (copy_to_user((void __user *)arg, &cursor, sizeof(cursor)) != 0)
+            {
+                return -EFAULT;
+            }
+            retval = 0;
+            break;
+
         default:
             return -ENOTTY;
     }
@@ -235,58 +854,176 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+/* Kernel address of page @param pgoff of the mapping described by struct aesd_mmap_header */
+static void *aesd_mmap_page(struct aesd_dev *dev, unsigned long pgoff)
+{
+    const struct aesd_mmap_header *header = dev->mmap_header;
+    unsigned long offset = pgoff << PAGE_SHIFT;
+
+    if (offset < header->index_offset)
+        return (char *)header + offset;
+    if (offset < header->data_offset)
+        return (char *)dev->byte_ring.record_start + (offset - header->index_offset);
+    if (offset - header->data_offset < header->data_size)
+        return dev->byte_ring.data + (offset - header->data_offset);
+    return NULL;
+}
+
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *p_aesd_dev = ((struct aesd_file *)filp->private_data)->dev;
+    unsigned long addr;
+    unsigned long pgoff = vma->vm_pgoff;
+    void *page;
+    int err;
+
+    /* Commands of the circular buffer are separate allocations, only the byte ring is contiguous */
+    if (!ring_bytes)
+        return -ENODEV;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+    for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE, pgoff++) {
+        page = aesd_mmap_page(p_aesd_dev, pgoff);
+        if (page == NULL)
+            return -EINVAL;
+        err = vm_insert_page(vma, addr, vmalloc_to_page(page));
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_dev *p_aesd_dev = ((struct aesd_file *)filp->private_data)->dev;
+    u64 start = ktime_get_ns();
+    long retval = aesd_do_ioctl(filp, cmd, arg);
+
+    aesd_stats_op_done(&p_aesd_dev->stats, AESD_OP_IOCTL, start);
+    return retval;
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
     .write =    aesd_write,
+    .write_iter = aesd_write_iter,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
     dev->cdev.ops = &aesd_fops;
     err = cdev_add (&dev->cdev, devno, 1);
     if (err) {
-        printk(KERN_ERR "Error %d adding aesd cdev", err);
+        printk(KERN_ERR "Error %d adding aesd cdev %d", err, index);
     }
     return err;
 }
 
+static void aesd_cleanup_device(struct aesd_dev *dev)
+{
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
 
+    cdev_del(&dev->cdev);
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circular_buffer, index) {
+        aesd_rcu_payload_put(entry->buffptr);
+    }
+    aesd_circular_buffer_cleanup(&dev->circular_buffer);
+    aesd_byte_ring_cleanup(&dev->byte_ring);
+    vfree(dev->mmap_header);
+    aesd_rcu_payload_put(dev->staging_buffer);
+    aesd_rcu_payload_put(dev->spare_payload);
+    aesd_stats_cleanup(&dev->stats);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    int i;
+
+    if (nr_devices < 1 || nr_devices > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "Invalid number of devices %d\n", nr_devices);
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, nr_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
+
+    aesd_devices = kcalloc(nr_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (aesd_devices == NULL) {
+        unregister_chrdev_region(dev, nr_devices);
+        return -ENOMEM;
+    }
+
+    result = aesd_rcu_payload_cache_init();
+    if (result) {
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, nr_devices);
+        return result;
+    }
+    aesd_stats_create_root();
 
     /**
      * TODO: initialize the AESD specific portion of the device
      */
-    aesd_circular_buffer_init(&aesd_device.circular_buffer, circular_buffer_size_mod_param);
-    memset(aesd_device.temp_buffer, 0, sizeof(aesd_device.temp_buffer));
-    aesd_device.temp_buffer_size = 0;
-    mutex_init(&aesd_device.lock);
+    for (i = 0; i < nr_devices; i++) {
+        struct aesd_dev *aesd_device = &aesd_devices[i];
+        char name[16];
 
-    result = aesd_setup_cdev(&aesd_device);
+        aesd_circular_buffer_init(&aesd_device->circular_buffer, circular_buffer_size_mod_param);
+        mutex_init(&aesd_device->lock);
+        init_waitqueue_head(&aesd_device->wait_queue);
+        seqcount_mutex_init(&aesd_device->circular_buffer_seq, &aesd_device->lock);
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+        snprintf(name, sizeof(name), "aesdchar%d", i);
+        result = aesd_stats_init(&aesd_device->stats, name);
+        /* At least a page of ring so it can be mapped */
+        if (!result && ring_bytes)
+            result = aesd_byte_ring_init(&aesd_device->byte_ring, max_t(size_t, ring_bytes, PAGE_SIZE),
+                    max(ring_bytes / AESD_BYTE_RING_MIN_RECORD, 1U));
+        if (!result && ring_bytes)
+            result = aesd_mmap_init(aesd_device);
+        if (!result)
+            result = aesd_setup_cdev(aesd_device, i);
+        if( result ) {
+            aesd_circular_buffer_cleanup(&aesd_device->circular_buffer);
+            aesd_byte_ring_cleanup(&aesd_device->byte_ring);
+            vfree(aesd_device->mmap_header);
+            aesd_stats_cleanup(&aesd_device->stats);
+            while (i-- > 0)
+                aesd_cleanup_device(&aesd_devices[i]);
+            aesd_stats_remove_root();
+            aesd_rcu_payload_cache_destroy();
+            kfree(aesd_devices);
+            unregister_chrdev_region(dev, nr_devices);
+            return result;
+        }
     }
+    aesd_device_ready = true;
     return result;
 
 }
@@ -294,17 +1031,18 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-
-    cdev_del(&aesd_device.cdev);
+    int i;
 
     /**
      * TODO: cleanup AESD specific poritions here as necessary
      */
-    aesd_circular_buffer_cleanup(&aesd_device.circular_buffer);
-
-    mutex_unlock(&aesd_device.lock);
+    for (i = 0; i < nr_devices; i++)
+        aesd_cleanup_device(&aesd_devices[i]);
+    aesd_stats_remove_root();
+    aesd_rcu_payload_cache_destroy();
+    kfree(aesd_devices);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, nr_devices);
 }
 
 
@@ -0,0 +1,203 @@
+/**
+ * @file newline-scan-benchmark.c
+ * @brief User space micro-benchmark of the record boundary scanners of aesd-newline-scan.c
+ *
+ * Splits a chunk of newline terminated records of a given size, the way the driver write path
+ * and aesdsocket framing do, with:
+ *  - byte_loop: the byte at a time loop aesdsocket used before the framing layer
+ *  - memchr: one memchr() call per record, as the framing layer and aesd_write_iter() did
+ *  - bytes, words, sse2, avx2: each aesd_newline_scan_*() implementation, collecting the
+ *    positions in batches like its callers
+ *  - dispatch: aesd_newline_scan(), which picks the implementation for the build and CPU
+ *
+ * Each result is printed on its own line as a JSON object, so runs can be compared by a script.
+ *
+ * Usage: newline-scan-benchmark [-c chunk_size] [-r repeats] [-s record_size[,record_size...]]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "aesd-newline-scan.h"
+
+#define BATCH 64
+#define MAX_RECORD_SIZES 16
+
+static size_t chunk_size = 1 << 20;
+static int repeats = 20;
+static size_t record_sizes[MAX_RECORD_SIZES] = { 16, 64, 256, 1024, 4096, 16384 };
+static int num_record_sizes = 6;
+
+// Accumulated from the results so the compiler can not drop the scans measured
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t split_byte_loop(const char *chunk, size_t len)
+{
+    size_t checksum = 0;
+    size_t start = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (chunk[i] == '\n')
+        {
+            checksum += i + 1 - start;
+            start = i + 1;
+        }
+    }
+    return checksum;
+}
+
+static size_t split_memchr(const char *chunk, size_t len)
+{
+    size_t checksum = 0;
+    const char *start = chunk;
+    const char *end = chunk + len;
+    const char *newline;
+
+    while ((newline = memchr(start, '\n', end - start)) != NULL)
+    {
+        checksum += newline + 1 - start;
+        start = newline + 1;
+    }
+    return checksum;
+}
+
+static size_t split_scanner(aesd_newline_scan_fn scan, const char *chunk, size_t len)
+{
+    size_t positions[BATCH];
+    size_t checksum = 0;
+    size_t start = 0;
+    size_t found = BATCH;
+
+    while (found == BATCH)
+    {
+        size_t i;
+        found = scan(chunk + start, len - start, positions, BATCH);
+        for (i = 0; i < found; i++)
+        {
+            checksum += positions[i] + 1 - (i ? positions[i - 1] + 1 : 0);
+        }
+        if (found > 0)
+            start += positions[found - 1] + 1;
+    }
+    return checksum;
+}
+
+static void bench(const char *name, aesd_newline_scan_fn scan, size_t (*split)(const char *, size_t),
+        const char *chunk, size_t record_size)
+{
+    double best = 0, total = 0;
+    size_t records = chunk_size / record_size;
+    size_t len = records * record_size;
+    int r;
+
+    for (r = 0; r < repeats; r++)
+    {
+        double start = now_ns();
+        size_t checksum = scan ? split_scanner(scan, chunk, len) : split(chunk, len);
+        double elapsed = now_ns() - start;
+        if (checksum != len)
+        {
+            fprintf(stderr, "%s split %zu bytes out of %zu\n", name, checksum, len);
+            exit(1);
+        }
+        sink += checksum;
+        total += elapsed;
+        if (r == 0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("{\"benchmark\":\"%s\",\"record_size\":%zu,\"chunk_size\":%zu,\"repeats\":%d,"
+           "\"best_ns_per_record\":%.3f,\"mean_ns_per_record\":%.3f,\"gb_per_s\":%.3f}\n",
+           name, record_size, len, repeats, best / records, total / repeats / records, len / best);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            chunk_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 's':
+        {
+            char *size = strtok(optarg, ",");
+            num_record_sizes = 0;
+            while (size != NULL && num_record_sizes < MAX_RECORD_SIZES)
+            {
+                record_sizes[num_record_sizes++] = strtoul(size, NULL, 10);
+                size = strtok(NULL, ",");
+            }
+            break;
+        }
+        default:
+            fprintf(stderr, "Usage: %s [-c chunk_size] [-r repeats] [-s record_size[,record_size...]]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int i;
+    for (i = 0; i < num_record_sizes; i++)
+    {
+        if (record_sizes[i] == 0 || record_sizes[i] > chunk_size)
+        {
+            fprintf(stderr, "Record sizes must be within 1-%zu\n", chunk_size);
+            return 1;
+        }
+    }
+    if (repeats < 1)
+    {
+        fprintf(stderr, "At least one repeat is needed\n");
+        return 1;
+    }
+
+    char *chunk = malloc(chunk_size);
+    if (chunk == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for (i = 0; i < num_record_sizes; i++)
+    {
+        size_t record_size = record_sizes[i];
+        size_t j;
+
+        // Printable records, each ending with its newline
+        for (j = 0; j < chunk_size; j++)
+        {
+            chunk[j] = j % record_size == record_size - 1 ? '\n' : 'a' + j % 26;
+        }
+
+        bench("byte_loop", NULL, split_byte_loop, chunk, record_size);
+        bench("memchr", NULL, split_memchr, chunk, record_size);
+        bench("bytes", aesd_newline_scan_bytes, NULL, chunk, record_size);
+        bench("words", aesd_newline_scan_words, NULL, chunk, record_size);
+#ifdef AESD_NEWLINE_SCAN_X86
+        bench("sse2", aesd_newline_scan_sse2, NULL, chunk, record_size);
+        if (__builtin_cpu_supports("avx2"))
+            bench("avx2", aesd_newline_scan_avx2, NULL, chunk, record_size);
+#endif
+        bench("dispatch", aesd_newline_scan, NULL, chunk, record_size);
+    }
+
+    free(chunk);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Counts the read() calls needed to read the whole aesdchar device
+# The device must be loaded, see aesdchar_load
+
+device=/dev/aesdchar
+block_size=4096
+param=/sys/module/aesdchar/parameters/circular_buffer_size
+
+while getopts "d:b:" opt; do
+	case ${opt} in
+		d )
+			device=$OPTARG
+			;;
+		b )
+			block_size=$OPTARG
+			;;
+		\? )
+			echo "Usage: $0 [-d device] [-b read_size]"
+			exit 1
+			;;
+	esac
+done
+
+entries=10
+if [ -r ${param} ]; then
+	entries=`cat ${param}`
+fi
+
+echo "Filling ${device} with ${entries} entries"
+i=1
+while [ ${i} -le ${entries} ]; do
+	echo "read syscall test entry ${i}" > ${device}
+	i=$((i + 1))
+done
+
+# dd reports one record per read() which returned data, full or partial
+result=`dd if=${device} of=/dev/null bs=${block_size} 2>&1`
+records=`echo "${result}" | awk -F'[+ ]' '/records in/ {print $1 + $2}'`
+bytes=`echo "${result}" | awk '/bytes/ {print $1}'`
+expected=$(( (bytes + block_size - 1) / block_size ))
+
+echo "entries=${entries} bytes=${bytes} read_size=${block_size} read_calls=${records} minimum_read_calls=${expected}"
+if [ ${records} -gt ${expected} ]; then
+	echo "TEST FAILED: a full device read needed ${records} read calls instead of ${expected}"
+	exit 1
+fi
+echo "TEST OK"
+exit 0
@@ -0,0 +1,103 @@
+#!/bin/sh
+# Resizes the aesdchar circular buffer while writers and readers use the device
+# The device must be loaded without lockless_read or ring_bytes, see aesdchar_load
+
+device=/dev/aesdchar
+writers=4
+lines=500
+resizes=200
+param=/sys/module/aesdchar/parameters/circular_buffer_size
+
+while getopts "d:w:l:r:" opt; do
+	case ${opt} in
+		d )
+			device=$OPTARG
+			;;
+		w )
+			writers=$OPTARG
+			;;
+		l )
+			lines=$OPTARG
+			;;
+		r )
+			resizes=$OPTARG
+			;;
+		\? )
+			echo "Usage: $0 [-d device] [-w writers] [-l lines_per_writer] [-r resizes]"
+			exit 1
+			;;
+	esac
+done
+
+if [ ! -w ${param} ]; then
+	echo "TEST FAILED: ${param} is not writable"
+	exit 1
+fi
+original_size=`cat ${param}`
+
+# Each writer writes numbered lines, one command per write
+writer() {
+	i=1
+	while [ ${i} -le ${lines} ]; do
+		echo "resize stress writer $1 line ${i}" > ${device}
+		i=$((i + 1))
+	done
+}
+
+# Readers only check the device stays readable, the content is checked at the end
+reader() {
+	while [ -e ${workdir}/running ]; do
+		cat ${device} > /dev/null || echo "read failed" >> ${workdir}/errors
+	done
+}
+
+workdir=`mktemp -d`
+touch ${workdir}/running ${workdir}/errors
+
+writer_pids=""
+w=1
+while [ ${w} -le ${writers} ]; do
+	writer ${w} &
+	writer_pids="${writer_pids} $!"
+	w=$((w + 1))
+done
+reader &
+reader_pid=$!
+
+echo "Resizing ${device} ${resizes} times while ${writers} writers write ${lines} lines each"
+r=1
+while [ ${r} -le ${resizes} ]; do
+	size=$(( `od -An -N1 -tu1 /dev/urandom` % 32 + 1 ))
+	echo ${size} > ${param} || echo "resize to ${size} failed" >> ${workdir}/errors
+	r=$((r + 1))
+done
+
+wait ${writer_pids}
+rm ${workdir}/running
+wait ${reader_pid}
+
+final_size=`cat ${param}`
+cat ${device} > ${workdir}/content
+count=`wc -l < ${workdir}/content`
+
+# Lines must be intact and, for each writer, in the order they were written
+bad=`awk '
+	!/^resize stress writer [0-9]+ line [0-9]+$/ { bad++; next }
+	{ if ($6 <= last[$4]) bad++; last[$4] = $6 }
+	END { print bad + 0 }' ${workdir}/content`
+errors=`wc -l < ${workdir}/errors`
+
+echo ${original_size} > ${param}
+rm -r ${workdir}
+
+echo "final_size=${final_size} lines=${count} bad_lines=${bad} errors=${errors}"
+if [ ${count} -gt ${final_size} ]; then
+	echo "TEST FAILED: ${count} commands stored in a buffer of ${final_size}"
+	exit 1
+fi
+if [ ${bad} -ne 0 ] || [ ${errors} -ne 0 ]; then
+	echo "TEST FAILED: ${bad} corrupted or out of order lines, ${errors} failed operations"
+	exit 1
+fi
+echo "TEST OK"
+exit 0
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <syslog.h>
 #include <signal.h>
@@ -11,34 +12,34 @@
 #include <netdb.h>
 #include <stdbool.h>
 #include <pthread.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
 
-#define USE_AESD_CHAR_DEVICE
-
-#define PORT 9000
-#ifdef USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
-#else
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif /* USE_AESD_CHAR_DEVICE */
 #define MAX_CLIENTS 500
 #define TIMESTAMP_INTERVAL 10
-#define AESDCHAR_PATTERN "AESDCHAR_IOCSEEKTO"
+#define DEFAULT_EPOLL_WORKERS 4
+#define RECV_CHUNK 4096
 
 static int server_socket = 0;
 static bool daemon_mode = false;
+static bool epoll_mode = false;
+static int epoll_workers = DEFAULT_EPOLL_WORKERS;
+static bool incremental_mode = false;
+static store_options_t store_options = { .sync_ms = STORE_SYNC_NONE };
 static pthread_t* thread_list[MAX_CLIENTS] = {NULL};
-static pthread_mutex_t mutex;
 
 typedef struct {
     pthread_t thread;
     int client_socket;
+    // Part of the data file already sent to the client in incremental mode
+    store_cursor_t cursor;
 } thread_info_t;
 
 void sigint_handler(int signo) {
     if (signo == SIGINT || signo == SIGTERM) {
         syslog(LOG_INFO, "Caught signal, exiting");
 
+        epoll_server_stop();
+
         int i;
         for (i = 0; i < MAX_CLIENTS; i++) {
             if (thread_list[i] != NULL) {
@@ -47,7 +48,7 @@ void sigint_handler(int signo) {
             }
         }
 
-        pthread_mutex_destroy(&mutex);
+        store_cleanup();
 
         shutdown(server_socket, SHUT_RDWR);
         #ifndef USE_AESD_CHAR_DEVICE
@@ -58,25 +59,64 @@ void sigint_handler(int signo) {
     }
 }
 
+/**
+ * Runs the command in the complete line of @param len bytes at @param line, received on the
+ * connection of @param arg, and sends the reply
+ */
+static int handle_line(void *arg, const char *line, size_t len)
+{
+    thread_info_t *thread_info = (thread_info_t *)arg;
+    store_cursor_t *cursor = incremental_mode ? &thread_info->cursor : NULL;
+    struct aesd_seekto seekto;
+
+    // The seekto command is run on the data file instead of being written to it
+    if (parse_seekto_command(line, len, &seekto))
+        return store_send_all(thread_info->client_socket, &seekto, cursor);
+
+    if (store_append(line, len) != 0)
+        return -1;
+    return store_send_all(thread_info->client_socket, NULL, cursor);
+}
+
+/**
+ * Keeps the old behaviour of storing data received without a trailing newline
+ */
+static void store_partial_line(frame_buffer_t *frame)
+{
+    if (frame->len > 0)
+        store_append(frame->data, frame->len);
+    frame->len = 0;
+}
+
 void *handle_connection(void *arg) {
     struct sockaddr_in client_addr = {0};
     socklen_t client_addr_len = sizeof(client_addr);
-    char buffer[1024] = {0};
-    FILE *data_file = NULL;
     thread_info_t *thread_info = (thread_info_t *)arg;
+    frame_buffer_t frame = {0};
+
+    store_cursor_init(&thread_info->cursor);
 
     if (getpeername(thread_info->client_socket, (struct sockaddr *)&client_addr, &client_addr_len) == 0) {
         syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(client_addr.sin_addr));
     }
 
     while (1) {
-        ssize_t bytes_received = recv(thread_info->client_socket, buffer, sizeof(buffer), 0);
+        size_t space;
+        char *buffer = frame_buffer_reserve(&frame, RECV_CHUNK, &space);
+        if (buffer == NULL) {
+            perror("Error allocating receive buffer");
+            break;
+        }
+
+        ssize_t bytes_received = recv(thread_info->client_socket, buffer, space, 0);
         if (bytes_received < 0) {
             fprintf(stderr, "Connection closed or error while receiving\n");
             break;
         }
         else if (bytes_received == 0)
         {
+            store_partial_line(&frame);
+
             // Listen for incoming connections
             if (listen(server_socket, MAX_CLIENTS) == -1) {
                 perror("Error listening for connections");
@@ -95,95 +135,51 @@ void *handle_connection(void *arg) {
                 pthread_exit(NULL);
                 exit(-1);
             }
+            // The new client has not been sent anything yet
+            store_cursor_release(&thread_info->cursor);
             continue;
         }
 
-        // Check the content of the message. If so, do the ioctl command and  
-        // do not write it to the socket.
-        char *ptr = strstr(buffer, AESDCHAR_PATTERN);
-        int x, y = -1;
-        uint8_t ioctl_cmd_found = 0;
-        if (ptr != NULL)
-        {
-            ptr += strlen(AESDCHAR_PATTERN);
-            if (sscanf(ptr, ":%d,%d", &x, &y) == 2)
-            {
-                ioctl_cmd_found = 1;
-            }
-        }
-        if (ioctl_cmd_found == 0)
-        {
-            pthread_mutex_lock(&mutex);
-            data_file = fopen(DATA_FILE, "a");
-            if (data_file == NULL) {
-                perror("Error opening data file");
-                free(thread_info);
-                pthread_mutex_unlock(&mutex);
-                pthread_exit(NULL);
-                exit(-1);
-            }
-
-            fwrite(buffer, 1, bytes_received, data_file);
-
-            fclose(data_file);
-            pthread_mutex_unlock(&mutex);
-        }
-
-        // Check for a newline character to determine the end of a packet
-        bool newline_found = false;
-        for (int i = 0; bytes_received > i; i++)
-        {
-            if (buffer[i] == '\n')
-            {
-                newline_found = true;
-                break;
-            }
-        }
-        if (newline_found) {
-            // Send the content of the data file back to the client
-            pthread_mutex_lock(&mutex);
-            data_file = fopen(DATA_FILE, "r");
-
-            if (ioctl_cmd_found)
-            {
-                int fd = fileno(data_file);
-                struct aesd_seekto seekto;
-                seekto.write_cmd = x;
-                seekto.write_cmd_offset = y;
-                int result_ret = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
-                if (result_ret != 0)
-                {
-                    perror("Error executing ioctl");
-                }
-            }
-
-            if (data_file == NULL) {
-                perror("Error opening data file");
-                free(thread_info);
-                pthread_exit(NULL);
-                exit(-1);
-            }
-            char *line = NULL;
-            size_t length = 0;
-            ssize_t bytes_read = 0;
-            while ((bytes_read = getline(&line, &length, data_file)) > 0) {
-                if (send(thread_info->client_socket, line, bytes_read, 0) == -1) {
-                    perror("Error sending data");
-                    break;
-                }
-            }
-            free(line);
-            fclose(data_file);
-            pthread_mutex_unlock(&mutex);
-        }
+        // Run every command completed by these bytes, in the order they were sent. The socket
+        // is corked meanwhile so the replies to pipelined commands go out in full packets.
+        setsockopt(thread_info->client_socket, IPPROTO_TCP, TCP_CORK, &(int){1}, sizeof(int));
+        int ret = frame_buffer_commit(&frame, bytes_received, handle_line, thread_info);
+        setsockopt(thread_info->client_socket, IPPROTO_TCP, TCP_CORK, &(int){0}, sizeof(int));
+        if (ret != 0)
+            break;
     }
 
     syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(client_addr.sin_addr));
+    store_partial_line(&frame);
+    frame_buffer_free(&frame);
+    store_cursor_release(&thread_info->cursor);
     close(thread_info->client_socket);
     free(thread_info);
     pthread_exit(NULL);
 }
 
+bool parse_seekto_command(const char *line, size_t len, struct aesd_seekto *seekto)
+{
+    char cmd[64];
+    unsigned int x, y;
+
+    if (len >= sizeof(cmd))
+        return false;
+    memcpy(cmd, line, len);
+    cmd[len] = '\0';
+
+    char *ptr = strstr(cmd, AESDCHAR_PATTERN);
+    if (ptr == NULL)
+        return false;
+    ptr += strlen(AESDCHAR_PATTERN);
+    if (sscanf(ptr, ":%u,%u", &x, &y) != 2)
+        return false;
+
+    seekto->write_cmd = x;
+    seekto->write_cmd_offset = y;
+    return true;
+}
+
 void *add_timestamps(void *arg) {
     while (1) {
         // Avoid compilation warning
@@ -200,20 +196,15 @@ void *add_timestamps(void *arg) {
             strftime(timestamp_str, sizeof(timestamp_str), "timestamp:%a, %d %b %Y %H:%M:%S %z", time_info);
             
             // Abre el archivo y escribe el timestamp
-            pthread_mutex_lock(&mutex);
-            FILE *data_file = fopen(DATA_FILE, "a");
-            if (data_file != NULL) {
-                fprintf(data_file, "%s\n", timestamp_str);
-                fclose(data_file);
-            }
-            pthread_mutex_unlock(&mutex);
+            strcat(timestamp_str, "\n");
+            store_append(timestamp_str, strlen(timestamp_str));
             
             sleep(TIMESTAMP_INTERVAL);
         }
     }
 }
 
-static int handle_thread(void)
+void start_timestamp_thread(void)
 {
     #ifndef USE_AESD_CHAR_DEVICE
     // Handle timestamp
@@ -223,6 +214,16 @@ static int handle_thread(void)
         exit(-1);
     }
     #endif /* USE_AESD_CHAR_DEVICE */
+}
+
+static int handle_thread(void)
+{
+    if (epoll_mode)
+    {
+        return epoll_server_run(server_socket, epoll_workers, incremental_mode);
+    }
+
+    start_timestamp_thread();
 
     while (1) {
         // Listen for incoming connections
@@ -265,9 +266,54 @@ int main(int argc, char *argv[]) {
     openlog("aesd_socket_server", LOG_PID | LOG_NDELAY | LOG_NOWAIT, LOG_LOCAL1);
 
     // Parse input arguments
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = true;
-        printf("Daemon mode!\n");
+    int opt;
+    while ((opt = getopt(argc, argv, "dew:pigf:l:")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = true;
+                printf("Daemon mode!\n");
+                break;
+            case 'e':
+                epoll_mode = true;
+                break;
+            case 'w':
+                epoll_workers = atoi(optarg);
+                break;
+            case 'p':
+                store_options.persistent = true;
+                break;
+            case 'i':
+                // Only send each client the data it has not received yet
+                incremental_mode = true;
+                break;
+            case 'g':
+                // Append to the data file in batches from a single writer thread
+                store_options.group_commit = true;
+                break;
+            case 'f':
+                // Sync policy of the writer: none, batch or an interval in milliseconds
+                if (strcmp(optarg, "none") == 0)
+                    store_options.sync_ms = STORE_SYNC_NONE;
+                else if (strcmp(optarg, "batch") == 0)
+                    store_options.sync_ms = STORE_SYNC_BATCH;
+                else if ((store_options.sync_ms = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "Invalid sync policy %s, expected none, batch or milliseconds\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'l':
+                // Segmented log of the plain file backend, retired past max_size bytes or max_age seconds
+                if (sscanf(optarg, "%zu,%zu,%d", &store_options.segment_size, &store_options.max_size,
+                           &store_options.max_age) < 1 || store_options.segment_size == 0) {
+                    fprintf(stderr, "Invalid log option %s, expected segment_size[,max_size[,max_age]]\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-e [-w workers]] [-p] [-i] [-g [-f none|batch|ms]]\n"
+                        "          [-l segment_size[,max_size[,max_age]]]\n", argv[0]);
+                return -1;
+        }
     }
 
     // Create a socket
@@ -292,8 +338,13 @@ int main(int argc, char *argv[]) {
 
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
+    // A client closing early must not kill the server while its reply is sent
+    signal(SIGPIPE, SIG_IGN);
 
-    pthread_mutex_init(&mutex, NULL);
+    if (store_init(&store_options) != 0) {
+        close(server_socket);
+        return -1;
+    }
 
     if (daemon_mode)
     {
@@ -0,0 +1,238 @@
+/*
+ * aesdsocket.h
+ *
+ * Definitions shared between the aesdsocket server modes
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+// The char device is the default backend, build with -DUSE_AESD_DATA_FILE to use the plain file
+#ifndef USE_AESD_DATA_FILE
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE
+#endif
+#endif
+
+#define PORT 9000
+#ifdef USE_AESD_CHAR_DEVICE
+#define DATA_FILE "/dev/aesdchar"
+#else
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#endif /* USE_AESD_CHAR_DEVICE */
+#define DATA_LOG_DIR "/var/tmp/aesdsocketlog"
+#define AESDCHAR_PATTERN "AESDCHAR_IOCSEEKTO"
+
+// Sync policies of the group commit writer, a positive value is an interval in milliseconds
+#define STORE_SYNC_NONE -1
+#define STORE_SYNC_BATCH 0
+
+/**
+ * Data file access options, group commit and the log only apply to the plain file backend
+ */
+typedef struct {
+    // Keep the data file open for the lifetime of the server and read it back in large chunks
+    bool persistent;
+    // Queue appends for a single writer thread writing them in batches, synced as selected by sync_ms
+    bool group_commit;
+    int sync_ms;
+    // Store the data in a segmented log of segment_size bytes segments in DATA_LOG_DIR instead of
+    // DATA_FILE when not 0. Segments are retired past max_size bytes or max_age seconds, 0 for no limit.
+    size_t segment_size;
+    size_t max_size;
+    int max_age;
+} store_options_t;
+
+/**
+ * Initializes the data file access as selected by @param options
+ * @return 0 on success, -1 on error
+ */
+int store_init(const store_options_t *options);
+
+/**
+ * Releases the resources allocated by store_init()
+ */
+void store_cleanup(void);
+
+/**
+ * Appends @param len bytes from @param data to the data file. With group commit the call
+ * returns once the writer has written the batch holding them, and synced it with STORE_SYNC_BATCH.
+ * @return 0 on success, -1 on error
+ */
+int store_append(const char *data, size_t len);
+
+/**
+ * Read position of a connection in incremental mode, where only the data the client
+ * has not been sent yet is sent back
+ */
+typedef struct {
+    // Char device backend: the connection reads its own file, the driver keeps its position
+    int fd;
+    // Plain file backend: offset of the first byte not sent yet
+    off_t offset;
+} store_cursor_t;
+
+/**
+ * Initializes @param cursor to the start of the data file
+ */
+void store_cursor_init(store_cursor_t *cursor);
+
+/**
+ * Releases the resources of @param cursor
+ */
+void store_cursor_release(store_cursor_t *cursor);
+
+/**
+ * Sends the content of the data file to the blocking @param client_socket. When @param seekto
+ * is not NULL the content starts at the position selected with the AESDCHAR_IOCSEEKTO ioctl.
+ * Otherwise, when @param cursor is not NULL, only the content after the cursor is sent.
+ * The cursor is then moved past the data sent.
+ * @return 0 on success, -1 on error
+ */
+int store_send_all(int client_socket, const struct aesd_seekto *seekto, store_cursor_t *cursor);
+
+/**
+ * Appends the content of the data file to the growable buffer described by @param buf,
+ * @param buf_len and @param buf_cap. When @param seekto is not NULL the read starts
+ * at the position selected with the AESDCHAR_IOCSEEKTO ioctl. Otherwise, when @param cursor
+ * is not NULL, it starts at the cursor. The cursor is then moved past the data read.
+ * @return 0 on success, -1 on error
+ */
+int store_read_all(const struct aesd_seekto *seekto, store_cursor_t *cursor, char **buf, size_t *buf_len, size_t *buf_cap);
+
+/**
+ * Writes the @param count buffers of @param iov to @param fd, resuming after short writes,
+ * which updates the iov entries.
+ * @return 0 on success, -1 on error
+ */
+int writev_all(int fd, struct iovec *iov, int count);
+
+/**
+ * Segment of the log, see aesdsocket_log.c
+ */
+typedef struct log_segment log_segment_t;
+
+/**
+ * Bytes [start, end) of a log segment, which stays readable through fd until log_put_ranges()
+ */
+typedef struct {
+    log_segment_t *segment;
+    int fd;
+    off_t start;
+    off_t end;
+} log_range_t;
+
+/**
+ * Creates the log in @param dir, removing the segments of a previous run, with the limits of
+ * store_options_t @param segment_size, @param max_size and @param max_age.
+ * @return 0 on success, -1 on error
+ */
+int log_open(const char *dir, size_t segment_size, size_t max_size, int max_age);
+
+/**
+ * Removes the segments and the directory of the log
+ */
+void log_close(void);
+
+/**
+ * Appends the @param count buffers of @param iov, each one a record or the continuation of a
+ * record not ending with a newline yet, with as few writes as the segment boundaries allow.
+ * @return 0 on success, -1 on error
+ */
+int log_append(struct iovec *iov, int count);
+
+/**
+ * @return the stream offset following the last byte of the log
+ */
+off_t log_end_offset(void);
+
+/**
+ * Finds the stream offset of the AESDCHAR_IOCSEEKTO position @param seekto, record 0 being the
+ * oldest one kept, and stores it in @param offset.
+ * @return 0 on success, -1 if the position is not in the log
+ */
+int log_seek(const struct aesd_seekto *seekto, off_t *offset);
+
+/**
+ * Allocates in @param ranges the @param count ranges of segments holding the log from the stream
+ * offset @param start, or from the oldest byte kept if start is older, up to its end.
+ * @return 0 on success, -1 on error
+ */
+int log_get_ranges(off_t start, log_range_t **ranges, int *count);
+
+/**
+ * Allocates in @param ranges the @param count segments written since the last call, to be synced
+ * @return 0 on success, -1 on error
+ */
+int log_get_dirty(log_range_t **ranges, int *count);
+
+/**
+ * Releases and frees the @param count @param ranges, may be called without the store mutex
+ */
+void log_put_ranges(log_range_t *ranges, int count);
+
+/**
+ * Input buffer of a connection, holding the start of a line until its newline is received
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} frame_buffer_t;
+
+/**
+ * Called for each complete line of @param len bytes at @param line, newline included.
+ * @return 0 to go on with the next line, -1 to stop
+ */
+typedef int (*frame_handler_t)(void *ctx, const char *line, size_t len);
+
+/**
+ * Makes room for at least @param min_space more bytes in @param frame.
+ * @return where to receive up to @param space bytes, or NULL if the allocation failed
+ */
+char *frame_buffer_reserve(frame_buffer_t *frame, size_t min_space, size_t *space);
+
+/**
+ * Adds the @param received bytes written after frame_buffer_reserve() to @param frame and calls
+ * @param handler with @param ctx for every line they complete, in order. The partial line left,
+ * if any, stays in frame->data for frame->len bytes.
+ * @return 0 on success, -1 if the handler failed
+ */
+int frame_buffer_commit(frame_buffer_t *frame, size_t received, frame_handler_t handler, void *ctx);
+
+/**
+ * Frees the memory of @param frame and empties it
+ */
+void frame_buffer_free(frame_buffer_t *frame);
+
+/**
+ * Checks if the @param len bytes in @param line hold an AESDCHAR_IOCSEEKTO:x,y command.
+ * @return true and fills @param seekto when the command was found
+ */
+bool parse_seekto_command(const char *line, size_t len, struct aesd_seekto *seekto);
+
+/**
+ * Starts the thread appending a timestamp to the data file every TIMESTAMP_INTERVAL seconds.
+ * Does nothing when the char device backend is used.
+ */
+void start_timestamp_thread(void);
+
+/**
+ * Serves clients on @param server_socket with non-blocking sockets and epoll, using
+ * @param num_workers worker threads. With @param incremental each client is only sent
+ * the data it has not seen yet. Only returns on error.
+ */
+int epoll_server_run(int server_socket, int num_workers, bool incremental);
+
+/**
+ * Cancels and joins the epoll worker threads. Called from the signal handler.
+ */
+void epoll_server_stop(void);
+
+#endif /* AESDSOCKET_H */
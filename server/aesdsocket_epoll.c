@@ -0,0 +1,302 @@
+/**
+ * @file aesdsocket_epoll.c
+ * @brief Event driven server mode for aesdsocket
+ *
+ * Clients are served by a small fixed set of worker threads sharing one epoll
+ * instance, so the number of connections is bounded by file descriptors instead
+ * of threads. Every socket is registered with EPOLLONESHOT, which guarantees a
+ * connection is handled by a single worker at a time.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "aesdsocket.h"
+
+#define MAX_EVENTS 64
+#define MAX_WORKERS 64
+#define RECV_CHUNK 4096
+
+typedef struct {
+    int fd;
+    struct sockaddr_in addr;
+    // Received bytes not yet terminated by a newline
+    frame_buffer_t in;
+    // Data to send back to the client, starting at out_off
+    char *out_buf;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    // Part of the data file already sent, in incremental mode
+    store_cursor_t cursor;
+} epoll_conn_t;
+
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static pthread_t workers[MAX_WORKERS];
+static int worker_count = 0;
+static bool incremental_mode = false;
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int rearm(int fd, uint32_t events, void *ptr)
+{
+    struct epoll_event ev = {0};
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = ptr;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void close_connection(epoll_conn_t *conn)
+{
+    // Keep the old behaviour of storing data received without a trailing newline
+    if (conn->in.len > 0)
+        store_append(conn->in.data, conn->in.len);
+
+    syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(conn->addr.sin_addr));
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    store_cursor_release(&conn->cursor);
+    frame_buffer_free(&conn->in);
+    free(conn->out_buf);
+    free(conn);
+}
+
+static void accept_connections(void)
+{
+    while (1) {
+        struct sockaddr_in client_addr = {0};
+        socklen_t client_addr_len = sizeof(client_addr);
+        int fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Error accepting connection");
+            break;
+        }
+
+        epoll_conn_t *conn = calloc(1, sizeof(epoll_conn_t));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->addr = client_addr;
+        store_cursor_init(&conn->cursor);
+        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(client_addr.sin_addr));
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("Error adding connection to epoll");
+            close(fd);
+            free(conn);
+        }
+    }
+    rearm(listen_fd, EPOLLIN, NULL);
+}
+
+/**
+ * Handles the complete line of @param len bytes at @param line, appending it to the
+ * data file and queueing the data file content to be sent back.
+ */
+static int handle_line(void *arg, const char *line, size_t len)
+{
+    epoll_conn_t *conn = arg;
+    struct aesd_seekto seekto;
+    store_cursor_t *cursor = incremental_mode ? &conn->cursor : NULL;
+
+    if (parse_seekto_command(line, len, &seekto))
+        return store_read_all(&seekto, cursor, &conn->out_buf, &conn->out_len, &conn->out_cap);
+
+    if (store_append(line, len) != 0)
+        return -1;
+    return store_read_all(NULL, cursor, &conn->out_buf, &conn->out_len, &conn->out_cap);
+}
+
+/**
+ * Sends the pending output of @param conn without blocking.
+ * @return 0 when everything was sent, 1 when the socket is full, -1 on error
+ */
+static int flush_output(epoll_conn_t *conn)
+{
+    while (conn->out_off < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out_buf + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        conn->out_off += sent;
+    }
+    conn->out_off = 0;
+    conn->out_len = 0;
+    return 0;
+}
+
+/**
+ * Reads everything available on @param conn and handles every complete line.
+ * @return 0 when the connection stays open, -1 when it must be closed
+ */
+static int read_input(epoll_conn_t *conn)
+{
+    while (1) {
+        size_t space;
+        char *buffer = frame_buffer_reserve(&conn->in, RECV_CHUNK, &space);
+        if (buffer == NULL)
+            return -1;
+
+        ssize_t bytes_received = recv(conn->fd, buffer, space, 0);
+        if (bytes_received == 0)
+            return -1;
+        if (bytes_received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (frame_buffer_commit(&conn->in, bytes_received, handle_line, conn) != 0)
+            return -1;
+
+        // Stop reading until the client has consumed the reply
+        if (conn->out_len > 0)
+            return 0;
+    }
+}
+
+static void handle_connection_event(epoll_conn_t *conn, uint32_t events)
+{
+    if (events & EPOLLERR) {
+        close_connection(conn);
+        return;
+    }
+
+    if (conn->out_len == 0 && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        if (read_input(conn) != 0) {
+            flush_output(conn);
+            close_connection(conn);
+            return;
+        }
+    }
+
+    int ret = flush_output(conn);
+    if (ret < 0) {
+        close_connection(conn);
+        return;
+    }
+    if (rearm(conn->fd, (ret == 1 ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP, conn) == -1) {
+        perror("Error rearming connection");
+        close_connection(conn);
+    }
+}
+
+static void *epoll_worker(void *arg)
+{
+    struct epoll_event events[MAX_EVENTS];
+    (void)arg;
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for events");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_connections();
+            else
+                handle_connection_event(events[i].data.ptr, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+int epoll_server_run(int server_socket, int num_workers, bool incremental)
+{
+    incremental_mode = incremental;
+    if (num_workers < 1)
+        num_workers = 1;
+    if (num_workers > MAX_WORKERS)
+        num_workers = MAX_WORKERS;
+
+    listen_fd = server_socket;
+    if (set_nonblocking(listen_fd) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+        perror("Error listening for connections");
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("Error creating epoll instance");
+        return -1;
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("Error adding server socket to epoll");
+        close(epoll_fd);
+        return -1;
+    }
+
+    start_timestamp_thread();
+
+    // Workers must not run the signal handler, it joins them from the main thread
+    sigset_t set, old_set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, &old_set);
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&workers[i], NULL, epoll_worker, NULL) != 0) {
+            perror("Error creating worker thread");
+            break;
+        }
+        worker_count++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+    if (worker_count == 0) {
+        close(epoll_fd);
+        return -1;
+    }
+    syslog(LOG_INFO, "Serving with epoll and %d worker threads", worker_count);
+
+    // The signal handler runs here and joins the workers before exiting
+    while (1)
+        pause();
+    return -1;
+}
+
+void epoll_server_stop(void)
+{
+    for (int i = 0; i < worker_count; i++) {
+        pthread_cancel(workers[i]);
+        pthread_join(workers[i], NULL);
+    }
+    worker_count = 0;
+}
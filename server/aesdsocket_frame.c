@@ -0,0 +1,67 @@
+/**
+ * @file aesdsocket_frame.c
+ * @brief Splitting of the byte stream received from a client into lines
+ *
+ * Each connection owns a growable input buffer. Received bytes are appended to it,
+ * every complete line is handed to the caller in order, so several commands sent
+ * in one packet are all run, and a partial line is kept until its newline arrives.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd-newline-scan.h"
+
+// Newline positions collected per scanner call
+#define SCAN_BATCH 64
+
+char *frame_buffer_reserve(frame_buffer_t *frame, size_t min_space, size_t *space)
+{
+    if (frame->cap - frame->len < min_space) {
+        size_t new_cap = frame->cap ? frame->cap * 2 : min_space * 2;
+        while (new_cap - frame->len < min_space)
+            new_cap *= 2;
+        char *new_data = realloc(frame->data, new_cap);
+        if (new_data == NULL)
+            return NULL;
+        frame->data = new_data;
+        frame->cap = new_cap;
+    }
+    *space = frame->cap - frame->len;
+    return frame->data + frame->len;
+}
+
+int frame_buffer_commit(frame_buffer_t *frame, size_t received, frame_handler_t handler, void *ctx)
+{
+    // Only the bytes just received can hold a newline not seen yet
+    size_t scan = frame->len;
+    size_t end = frame->len + received;
+    size_t line_start = 0;
+    size_t positions[SCAN_BATCH];
+    size_t found = SCAN_BATCH;
+    int ret = 0;
+
+    frame->len = end;
+    while (ret == 0 && found == SCAN_BATCH) {
+        found = aesd_newline_scan(frame->data + scan, end - scan, positions, SCAN_BATCH);
+        for (size_t i = 0; i < found && ret == 0; i++) {
+            size_t line_end = scan + positions[i] + 1;
+            ret = handler(ctx, frame->data + line_start, line_end - line_start);
+            line_start = line_end;
+        }
+        scan = line_start;
+    }
+
+    // Keep the partial line at the start of the buffer
+    if (line_start > 0) {
+        frame->len = end - line_start;
+        memmove(frame->data, frame->data + line_start, frame->len);
+    }
+    return ret;
+}
+
+void frame_buffer_free(frame_buffer_t *frame)
+{
+    free(frame->data);
+    memset(frame, 0, sizeof(*frame));
+}
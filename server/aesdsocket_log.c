@@ -0,0 +1,365 @@
+/**
+ * @file aesdsocket_log.c
+ * @brief Segmented and indexed log of the plain file backend
+ *
+ * The data is appended to segment files of a bounded size in DATA_LOG_DIR, each named after
+ * the stream offset of its first byte. Every segment keeps the offset of each record it holds,
+ * so the AESDCHAR_IOCSEEKTO position of a record is found with a binary search over the
+ * segments and an index lookup, without reading the data. A record is the data of one append,
+ * continued by the following appends until it ends with a newline, like a write command of
+ * the char device.
+ *
+ * The oldest segments are retired once the log holds more than max_size bytes or their last
+ * write is older than max_age seconds, the segment being written is always kept. Segments are
+ * reference counted, so a retired segment stays readable until the snapshots using it are sent.
+ *
+ * Except log_put_ranges(), the functions must be called with the store mutex held.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+
+#define SEGMENT_SUFFIX ".log"
+
+struct log_segment {
+    int fd;
+    int refs;
+    bool dirty;
+    // Stream offset of the first byte and number of the first record
+    off_t base;
+    uint64_t first_record;
+    // Bytes written to the segment
+    off_t size;
+    time_t last_write;
+    // Offset of each record from the start of the segment
+    uint32_t *records;
+    size_t num_records;
+    size_t records_cap;
+};
+
+static struct {
+    char dir[256];
+    size_t segment_size;
+    size_t max_size;
+    int max_age;
+    // Oldest segment first, the last one is written
+    log_segment_t **segments;
+    size_t num_segments;
+    size_t segments_cap;
+    // Whether the last record does not end with a newline yet
+    bool open_record;
+} data_log;
+
+static void segment_path(const log_segment_t *segment, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%020lld" SEGMENT_SUFFIX, data_log.dir, (long long)segment->base);
+}
+
+static void segment_put(log_segment_t *segment)
+{
+    if (__atomic_sub_fetch(&segment->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(segment->fd);
+        free(segment->records);
+        free(segment);
+    }
+}
+
+static log_segment_t *current_segment(void)
+{
+    return data_log.segments[data_log.num_segments - 1];
+}
+
+static off_t log_start_offset(void)
+{
+    return data_log.segments[0]->base;
+}
+
+off_t log_end_offset(void)
+{
+    log_segment_t *segment = current_segment();
+    return segment->base + segment->size;
+}
+
+/**
+ * Starts a new segment at the end of the log
+ * @return 0 on success, -1 on error
+ */
+static int add_segment(void)
+{
+    char path[PATH_MAX];
+    log_segment_t *segment = calloc(1, sizeof(*segment));
+
+    if (segment == NULL)
+        return -1;
+    if (data_log.num_segments > 0) {
+        log_segment_t *last = current_segment();
+        segment->base = last->base + last->size;
+        segment->first_record = last->first_record + last->num_records;
+    }
+    if (data_log.num_segments == data_log.segments_cap) {
+        size_t new_cap = data_log.segments_cap ? data_log.segments_cap * 2 : 16;
+        log_segment_t **new_segments = realloc(data_log.segments, new_cap * sizeof(*new_segments));
+        if (new_segments == NULL) {
+            free(segment);
+            return -1;
+        }
+        data_log.segments = new_segments;
+        data_log.segments_cap = new_cap;
+    }
+
+    segment_path(segment, path, sizeof(path));
+    // Written at the end, read with explicit offsets, so one descriptor does both
+    segment->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (segment->fd == -1) {
+        perror("Error creating log segment");
+        free(segment);
+        return -1;
+    }
+    segment->refs = 1;
+    segment->last_write = time(NULL);
+    data_log.segments[data_log.num_segments++] = segment;
+    return 0;
+}
+
+/**
+ * Retires the oldest segments beyond the size and age limits
+ */
+static void retire_segments(void)
+{
+    time_t now = time(NULL);
+
+    while (data_log.num_segments > 1) {
+        log_segment_t *oldest = data_log.segments[0];
+        bool too_big = data_log.max_size > 0 && (size_t)(log_end_offset() - log_start_offset()) > data_log.max_size;
+        bool too_old = data_log.max_age > 0 && now - oldest->last_write > data_log.max_age;
+        char path[PATH_MAX];
+
+        if (!too_big && !too_old)
+            break;
+        segment_path(oldest, path, sizeof(path));
+        unlink(path);
+        memmove(data_log.segments, data_log.segments + 1, (data_log.num_segments - 1) * sizeof(*data_log.segments));
+        data_log.num_segments--;
+        segment_put(oldest);
+    }
+}
+
+/**
+ * Removes the segments left in @param dir by a previous run
+ */
+static void remove_old_segments(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[PATH_MAX];
+
+    if (d == NULL)
+        return;
+    while ((entry = readdir(d)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > strlen(SEGMENT_SUFFIX) && strcmp(entry->d_name + len - strlen(SEGMENT_SUFFIX), SEGMENT_SUFFIX) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+int log_open(const char *dir, size_t segment_size, size_t max_size, int max_age)
+{
+    if (segment_size == 0 || segment_size > UINT32_MAX || strlen(dir) >= sizeof(data_log.dir)) {
+        fprintf(stderr, "Invalid log segment size %zu\n", segment_size);
+        return -1;
+    }
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("Error creating log directory");
+        return -1;
+    }
+    remove_old_segments(dir);
+
+    memset(&data_log, 0, sizeof(data_log));
+    strcpy(data_log.dir, dir);
+    data_log.segment_size = segment_size;
+    data_log.max_size = max_size;
+    data_log.max_age = max_age;
+    return add_segment();
+}
+
+void log_close(void)
+{
+    size_t i;
+
+    for (i = 0; i < data_log.num_segments; i++) {
+        char path[PATH_MAX];
+        segment_path(data_log.segments[i], path, sizeof(path));
+        unlink(path);
+        segment_put(data_log.segments[i]);
+    }
+    free(data_log.segments);
+    rmdir(data_log.dir);
+    memset(&data_log, 0, sizeof(data_log));
+}
+
+/**
+ * Adds a record starting at @param offset to the index of @param segment
+ */
+static int index_record(log_segment_t *segment, off_t offset)
+{
+    if (segment->num_records == segment->records_cap) {
+        size_t new_cap = segment->records_cap ? segment->records_cap * 2 : 256;
+        uint32_t *new_records = realloc(segment->records, new_cap * sizeof(*new_records));
+        if (new_records == NULL)
+            return -1;
+        segment->records = new_records;
+        segment->records_cap = new_cap;
+    }
+    segment->records[segment->num_records++] = offset;
+    return 0;
+}
+
+int log_append(struct iovec *iov, int count)
+{
+    int first = 0;
+
+    while (first < count) {
+        log_segment_t *segment = current_segment();
+        size_t old_records = segment->num_records;
+        bool old_open = data_log.open_record;
+        off_t size = segment->size;
+        int last;
+
+        // A new record goes to a new segment when it does not fit, records never span segments
+        for (last = first; last < count; last++) {
+            size_t len = iov[last].iov_len;
+            if (len == 0)
+                continue;
+            if (!data_log.open_record) {
+                if (size > 0 && (size_t)size + len > data_log.segment_size)
+                    break;
+                if (index_record(segment, size) != 0) {
+                    segment->num_records = old_records;
+                    data_log.open_record = old_open;
+                    return -1;
+                }
+            }
+            size += len;
+            data_log.open_record = ((const char *)iov[last].iov_base)[len - 1] != '\n';
+        }
+
+        if (writev_all(segment->fd, iov + first, last - first) != 0) {
+            segment->num_records = old_records;
+            data_log.open_record = old_open;
+            return -1;
+        }
+        segment->size = size;
+        segment->dirty = true;
+        segment->last_write = time(NULL);
+
+        first = last;
+        if (first < count && add_segment() != 0)
+            return -1;
+    }
+    retire_segments();
+    return 0;
+}
+
+int log_seek(const struct aesd_seekto *seekto, off_t *offset)
+{
+    log_segment_t *segment = current_segment();
+    uint64_t record = data_log.segments[0]->first_record + seekto->write_cmd;
+    size_t low = 0, high = data_log.num_segments - 1;
+
+    if (record >= segment->first_record + segment->num_records)
+        return -1;
+
+    // Last segment starting at or before the record
+    while (low < high) {
+        size_t mid = (low + high + 1) / 2;
+        if (data_log.segments[mid]->first_record <= record)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    segment = data_log.segments[low];
+
+    size_t index = record - segment->first_record;
+    off_t start = segment->records[index];
+    off_t end = index + 1 < segment->num_records ? segment->records[index + 1] : segment->size;
+    if (seekto->write_cmd_offset >= end - start)
+        return -1;
+    *offset = segment->base + start + seekto->write_cmd_offset;
+    return 0;
+}
+
+int log_get_ranges(off_t start, log_range_t **ranges, int *count)
+{
+    size_t first = 0, i;
+
+    retire_segments();
+    if (start < log_start_offset())
+        start = log_start_offset();
+    if (start > log_end_offset())
+        start = log_end_offset();
+    while (first + 1 < data_log.num_segments && data_log.segments[first + 1]->base <= start)
+        first++;
+
+    *count = 0;
+    *ranges = malloc((data_log.num_segments - first) * sizeof(**ranges));
+    if (*ranges == NULL)
+        return -1;
+    for (i = first; i < data_log.num_segments; i++) {
+        log_segment_t *segment = data_log.segments[i];
+        log_range_t *range = &(*ranges)[(*count)++];
+
+        __atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+        range->segment = segment;
+        range->fd = segment->fd;
+        range->start = start > segment->base ? start - segment->base : 0;
+        range->end = segment->size;
+    }
+    return 0;
+}
+
+int log_get_dirty(log_range_t **ranges, int *count)
+{
+    size_t i;
+
+    *count = 0;
+    *ranges = malloc(data_log.num_segments * sizeof(**ranges));
+    if (*ranges == NULL)
+        return -1;
+    for (i = 0; i < data_log.num_segments; i++) {
+        log_segment_t *segment = data_log.segments[i];
+        if (!segment->dirty)
+            continue;
+        log_range_t *range = &(*ranges)[(*count)++];
+
+        __atomic_add_fetch(&segment->refs, 1, __ATOMIC_RELAXED);
+        segment->dirty = false;
+        range->segment = segment;
+        range->fd = segment->fd;
+        range->start = 0;
+        range->end = segment->size;
+    }
+    return 0;
+}
+
+void log_put_ranges(log_range_t *ranges, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        segment_put(ranges[i].segment);
+    free(ranges);
+}
@@ -0,0 +1,625 @@
+/**
+ * @file aesdsocket_store.c
+ * @brief Access to the aesdsocket data file or char device
+ *
+ * By default every operation opens and closes the data file, like the original
+ * implementation. In persistent mode the data file is opened once instead.
+ *
+ * The mutex only protects appends and the capture of a snapshot of the content,
+ * the snapshot is streamed back in large chunks after releasing it, with sendfile()
+ * for the plain file backend.
+ *
+ * With group commit, appends to the plain file are queued and a single writer thread
+ * writes every record queued meanwhile with one writev() on a long-lived descriptor,
+ * so concurrent writers share the syscalls and the optional fdatasync() of a batch.
+ *
+ * With a log, the plain file backend is a segmented log of bounded size instead of a
+ * single file, see aesdsocket_log.c, and a snapshot is a range of each segment.
+ *
+ * In incremental mode each connection has a cursor and a snapshot only covers the
+ * data after it. The plain file only grows, so the cursor is an offset. Entries of the
+ * char device are overwritten, so the connection keeps its own open file instead and
+ * reads it sequentially, the driver keeping its position across overwritten entries.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "aesdsocket.h"
+
+#define STREAM_CHUNK (64 * 1024)
+// Records written per writev() call by the group commit writer
+#define WRITER_IOV 64
+
+/**
+ * Consistent view of the data file taken with the mutex held and sent after releasing it
+ */
+typedef struct {
+    // Plain file backend: the file only grows, so the range [start, end) of fd never changes
+    int fd;
+    bool owns_fd;
+    off_t start;
+    off_t end;
+    // Log: the ranges of the segments to send
+    log_range_t *ranges;
+    int num_ranges;
+    // Char device backend: entries may be overwritten once the mutex is released, the content is copied
+    char *data;
+    size_t len;
+} store_snapshot_t;
+
+/**
+ * Record waiting in the group commit queue, owned by the appending thread until done is set
+ */
+typedef struct store_record {
+    const char *data;
+    size_t len;
+    int status;
+    bool done;
+    struct store_record *next;
+} store_record_t;
+
+static pthread_mutex_t mutex;
+static bool persistent = false;
+static int append_fd = -1;
+static int read_fd = -1;
+static bool use_log = false;
+
+// Group commit writer, started by the first append so it runs in the daemon process
+static bool group_commit = false;
+static int sync_policy = STORE_SYNC_NONE;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static bool writer_running = false;
+static bool writer_stop = false;
+static pthread_t writer_thread;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static store_record_t *queue_head = NULL;
+static store_record_t **queue_tail = &queue_head;
+
+int store_init(const store_options_t *options)
+{
+    pthread_mutex_init(&mutex, NULL);
+    #ifndef USE_AESD_CHAR_DEVICE
+    // Each write to the device is a command of its own, appends are not batched nor logged
+    group_commit = options->group_commit;
+    sync_policy = options->sync_ms;
+    if (options->segment_size > 0) {
+        if (log_open(DATA_LOG_DIR, options->segment_size, options->max_size, options->max_age) != 0)
+            return -1;
+        use_log = true;
+        return 0;
+    }
+    #endif /* USE_AESD_CHAR_DEVICE */
+    // The writer appends through a long-lived descriptor, and no open() then runs with the mutex held
+    persistent = options->persistent || group_commit;
+    if (!persistent)
+        return 0;
+
+    append_fd = open(DATA_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    read_fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+    if (append_fd == -1 || read_fd == -1) {
+        perror("Error opening data file");
+        store_cleanup();
+        return -1;
+    }
+    return 0;
+}
+
+void store_cleanup(void)
+{
+    if (writer_running) {
+        // The writer drains the queue before exiting
+        pthread_mutex_lock(&queue_mutex);
+        writer_stop = true;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_mutex);
+        pthread_join(writer_thread, NULL);
+        writer_running = false;
+    }
+    if (use_log)
+        log_close();
+    use_log = false;
+    if (append_fd != -1)
+        close(append_fd);
+    if (read_fd != -1)
+        close(read_fd);
+    append_fd = -1;
+    read_fd = -1;
+    pthread_mutex_destroy(&mutex);
+}
+
+/**
+ * Returns the offset the read back starts at, applying @param seekto on @param fd if not NULL.
+ * Must be called with the mutex held.
+ */
+static off_t start_offset(int fd, const struct aesd_seekto *seekto)
+{
+    if (seekto == NULL)
+        return 0;
+
+    struct aesd_seekto cmd = *seekto;
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &cmd) != 0) {
+        perror("Error executing ioctl");
+        return 0;
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    return offset < 0 ? 0 : offset;
+}
+
+/**
+ * Reads @param fd from @param offset, or from its current position when offset is -1, until
+ * @param end (or EOF when end is -1) into the growable buffer described by @param buf,
+ * @param buf_len and @param buf_cap
+ */
+static int read_range(int fd, off_t offset, off_t end, char **buf, size_t *buf_len, size_t *buf_cap)
+{
+    while (end < 0 || offset < end) {
+        if (*buf_cap - *buf_len < STREAM_CHUNK) {
+            size_t new_cap = *buf_cap ? *buf_cap * 2 : STREAM_CHUNK;
+            while (new_cap - *buf_len < STREAM_CHUNK)
+                new_cap *= 2;
+            char *new_buf = realloc(*buf, new_cap);
+            if (new_buf == NULL)
+                return -1;
+            *buf = new_buf;
+            *buf_cap = new_cap;
+        }
+        size_t chunk = *buf_cap - *buf_len;
+        if (end >= 0 && (off_t)chunk > end - offset)
+            chunk = end - offset;
+        ssize_t bytes_read = offset < 0 ? read(fd, *buf + *buf_len, chunk) :
+            pread(fd, *buf + *buf_len, chunk, offset);
+        if (bytes_read == 0)
+            break;
+        if (bytes_read == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        *buf_len += bytes_read;
+        if (offset >= 0)
+            offset += bytes_read;
+    }
+    return 0;
+}
+
+void store_cursor_init(store_cursor_t *cursor)
+{
+    cursor->fd = -1;
+    cursor->offset = 0;
+}
+
+void store_cursor_release(store_cursor_t *cursor)
+{
+    if (cursor->fd != -1)
+        close(cursor->fd);
+    store_cursor_init(cursor);
+}
+
+/**
+ * Returns the descriptor to take a snapshot from, setting @param owned when it must be closed
+ * once the snapshot is released. Must be called with the mutex held.
+ */
+static int open_read_fd(store_cursor_t *cursor, bool *owned)
+{
+    *owned = false;
+    #ifdef USE_AESD_CHAR_DEVICE
+    if (cursor != NULL) {
+        if (cursor->fd == -1)
+            cursor->fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+        return cursor->fd;
+    }
+    #else
+    (void)cursor;
+    #endif /* USE_AESD_CHAR_DEVICE */
+    if (persistent)
+        return read_fd;
+    *owned = true;
+    return open(DATA_FILE, O_RDONLY | O_CLOEXEC);
+}
+
+/**
+ * Captures the data to send back, starting at the position selected by @param seekto if not NULL,
+ * or else at @param cursor if not NULL, and moves the cursor past it.
+ * Only this step runs with the mutex held, so a slow client never blocks writers or other readers.
+ */
+static int take_snapshot(const struct aesd_seekto *seekto, store_cursor_t *cursor, store_snapshot_t *snap)
+{
+    bool owned;
+    int ret = 0;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->fd = -1;
+
+    pthread_mutex_lock(&mutex);
+    if (use_log) {
+        off_t offset = 0;
+        if (seekto != NULL) {
+            if (log_seek(seekto, &offset) != 0)
+                fprintf(stderr, "Invalid seekto position %u,%u\n", seekto->write_cmd, seekto->write_cmd_offset);
+        } else if (cursor != NULL) {
+            offset = cursor->offset;
+        }
+        ret = log_get_ranges(offset, &snap->ranges, &snap->num_ranges);
+        if (cursor != NULL)
+            cursor->offset = log_end_offset();
+        pthread_mutex_unlock(&mutex);
+        if (ret != 0)
+            perror("Error reading log");
+        return ret;
+    }
+    int fd = open_read_fd(cursor, &owned);
+    if (fd == -1) {
+        perror("Error opening data file");
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+    off_t offset = start_offset(fd, seekto);
+
+    #ifdef USE_AESD_CHAR_DEVICE
+    size_t cap = 0;
+    // The file of a cursor is read from its position, which the seekto ioctl may have just set
+    ret = read_range(fd, cursor != NULL ? -1 : offset, -1, &snap->data, &snap->len, &cap);
+    if (owned)
+        close(fd);
+    #else
+    struct stat st;
+    if (cursor != NULL && seekto == NULL)
+        offset = cursor->offset;
+    if (fstat(fd, &st) == -1) {
+        ret = -1;
+        if (owned)
+            close(fd);
+    } else {
+        snap->fd = fd;
+        snap->owns_fd = owned;
+        snap->start = offset;
+        snap->end = st.st_size;
+        if (cursor != NULL)
+            cursor->offset = st.st_size;
+    }
+    #endif /* USE_AESD_CHAR_DEVICE */
+    pthread_mutex_unlock(&mutex);
+
+    if (ret != 0)
+        perror("Error reading data file");
+    return ret;
+}
+
+static void release_snapshot(store_snapshot_t *snap)
+{
+    if (snap->ranges != NULL)
+        log_put_ranges(snap->ranges, snap->num_ranges);
+    if (snap->owns_fd)
+        close(snap->fd);
+    free(snap->data);
+}
+
+int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the records of @param batch in order, WRITER_IOV of them per writev().
+ * The mutex is held so a snapshot never covers part of a batch.
+ */
+static int write_batch(store_record_t *batch)
+{
+    struct iovec iov[WRITER_IOV];
+    int ret = 0;
+
+    pthread_mutex_lock(&mutex);
+    while (batch != NULL && ret == 0) {
+        int count = 0;
+        for (; batch != NULL && count < WRITER_IOV; batch = batch->next) {
+            iov[count].iov_base = (void *)batch->data;
+            iov[count].iov_len = batch->len;
+            count++;
+        }
+        ret = use_log ? log_append(iov, count) : writev_all(append_fd, iov, count);
+    }
+    pthread_mutex_unlock(&mutex);
+    if (ret != 0)
+        perror("Error writing data file");
+    return ret;
+}
+
+/**
+ * Syncs the data written by the writer, with the log only the segments written since the last sync
+ */
+static int sync_data(void)
+{
+    log_range_t *ranges;
+    int count, ret;
+
+    if (!use_log)
+        return fdatasync(append_fd);
+
+    pthread_mutex_lock(&mutex);
+    ret = log_get_dirty(&ranges, &count);
+    pthread_mutex_unlock(&mutex);
+    if (ret != 0)
+        return ret;
+    for (int i = 0; i < count && ret == 0; i++)
+        ret = fdatasync(ranges[i].fd);
+    log_put_ranges(ranges, count);
+    return ret;
+}
+
+static void *writer_main(void *arg)
+{
+    struct timespec next_sync;
+    store_record_t *batch;
+    bool dirty = false;
+    (void)arg;
+
+    clock_gettime(CLOCK_MONOTONIC, &next_sync);
+    while (1) {
+        // Wait for records, or with an interval policy for the next sync of written data
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_head == NULL && !writer_stop) {
+            if (dirty && sync_policy > 0) {
+                if (pthread_cond_timedwait(&queue_cond, &queue_mutex, &next_sync) == ETIMEDOUT)
+                    break;
+            } else {
+                pthread_cond_wait(&queue_cond, &queue_mutex);
+            }
+        }
+        batch = queue_head;
+        queue_head = NULL;
+        queue_tail = &queue_head;
+        if (batch == NULL && writer_stop) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        int status = 0;
+        if (batch != NULL) {
+            status = write_batch(batch);
+            dirty = true;
+            if (status == 0 && sync_policy == STORE_SYNC_BATCH) {
+                status = sync_data();
+                if (status != 0)
+                    perror("Error syncing data file");
+                dirty = false;
+            }
+
+            // The records are acknowledged before an interval sync, which the clients do not wait for
+            pthread_mutex_lock(&queue_mutex);
+            for (; batch != NULL; batch = batch->next) {
+                batch->status = status;
+                batch->done = true;
+            }
+            pthread_cond_broadcast(&done_cond);
+            pthread_mutex_unlock(&queue_mutex);
+        }
+        if (dirty && sync_policy > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > next_sync.tv_sec ||
+                (now.tv_sec == next_sync.tv_sec && now.tv_nsec >= next_sync.tv_nsec)) {
+                if (sync_data() != 0)
+                    perror("Error syncing data file");
+                dirty = false;
+                next_sync.tv_sec = now.tv_sec + sync_policy / 1000;
+                next_sync.tv_nsec = now.tv_nsec + (sync_policy % 1000) * 1000000L;
+                if (next_sync.tv_nsec >= 1000000000L) {
+                    next_sync.tv_sec++;
+                    next_sync.tv_nsec -= 1000000000L;
+                }
+            }
+        }
+    }
+    if (dirty && sync_policy != STORE_SYNC_NONE && sync_data() != 0)
+        perror("Error syncing data file");
+    return NULL;
+}
+
+static void start_writer(void)
+{
+    pthread_condattr_t attr;
+
+    // The sync deadlines are on the monotonic clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_destroy(&queue_cond);
+    pthread_cond_init(&queue_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0)
+        perror("Error creating writer thread, appending directly");
+    else
+        writer_running = true;
+}
+
+/**
+ * Queues @param len bytes from @param data for the writer and waits until they are written
+ */
+static int group_append(const char *data, size_t len)
+{
+    store_record_t record = { .data = data, .len = len, .status = 0, .done = false, .next = NULL };
+    int old_state;
+
+    // The writer reads the record from this stack, so the thread can not be cancelled before it is done
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_head == NULL)
+        pthread_cond_signal(&queue_cond);
+    *queue_tail = &record;
+    queue_tail = &record.next;
+    while (!record.done)
+        pthread_cond_wait(&done_cond, &queue_mutex);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_setcancelstate(old_state, NULL);
+    return record.status;
+}
+
+int store_append(const char *data, size_t len)
+{
+    if (group_commit) {
+        pthread_once(&writer_once, start_writer);
+        if (writer_running)
+            return group_append(data, len);
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (use_log) {
+        struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+        int ret = log_append(&iov, 1);
+        if (ret != 0)
+            perror("Error writing log");
+        pthread_mutex_unlock(&mutex);
+        return ret;
+    }
+    if (persistent) {
+        while (len > 0) {
+            ssize_t written = write(append_fd, data, len);
+            if (written == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error writing data file");
+                pthread_mutex_unlock(&mutex);
+                return -1;
+            }
+            data += written;
+            len -= written;
+        }
+        pthread_mutex_unlock(&mutex);
+        return 0;
+    }
+
+    FILE *data_file = fopen(DATA_FILE, "a");
+    if (data_file == NULL) {
+        perror("Error opening data file");
+        pthread_mutex_unlock(&mutex);
+        return -1;
+    }
+
+    fwrite(data, 1, len, data_file);
+
+    fclose(data_file);
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+static int send_all(int client_socket, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(client_socket, data, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Sends the bytes [@param start, @param end) of the regular file @param fd, letting the kernel
+ * move the pages straight to the socket
+ */
+static int send_file_range(int client_socket, int fd, off_t start, off_t end)
+{
+    while (start < end) {
+        ssize_t sent = sendfile(client_socket, fd, &start, end - start);
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int store_send_all(int client_socket, const struct aesd_seekto *seekto, store_cursor_t *cursor)
+{
+    store_snapshot_t snap;
+    int ret = 0;
+
+    if (take_snapshot(seekto, cursor, &snap) != 0)
+        return -1;
+
+    if (snap.data != NULL) {
+        ret = send_all(client_socket, snap.data, snap.len);
+    }
+    if (snap.fd != -1)
+        ret = send_file_range(client_socket, snap.fd, snap.start, snap.end);
+    for (int i = 0; i < snap.num_ranges && ret == 0; i++)
+        ret = send_file_range(client_socket, snap.ranges[i].fd, snap.ranges[i].start, snap.ranges[i].end);
+    if (ret != 0)
+        perror("Error sending data");
+
+    release_snapshot(&snap);
+    return ret;
+}
+
+int store_read_all(const struct aesd_seekto *seekto, store_cursor_t *cursor, char **buf, size_t *buf_len, size_t *buf_cap)
+{
+    store_snapshot_t snap;
+    int ret = 0;
+
+    if (take_snapshot(seekto, cursor, &snap) != 0)
+        return -1;
+
+    if (snap.data != NULL) {
+        if (*buf_len == 0) {
+            // Hand over the snapshot buffer instead of copying it
+            free(*buf);
+            *buf = snap.data;
+            *buf_len = snap.len;
+            *buf_cap = snap.len;
+            snap.data = NULL;
+        } else {
+            char *new_buf = realloc(*buf, *buf_len + snap.len);
+            if (new_buf == NULL) {
+                ret = -1;
+            } else {
+                memcpy(new_buf + *buf_len, snap.data, snap.len);
+                *buf = new_buf;
+                *buf_len += snap.len;
+                *buf_cap = *buf_len;
+            }
+        }
+    }
+    if (snap.fd != -1)
+        ret = read_range(snap.fd, snap.start, snap.end, buf, buf_len, buf_cap);
+    for (int i = 0; i < snap.num_ranges && ret == 0; i++)
+        ret = read_range(snap.ranges[i].fd, snap.ranges[i].start, snap.ranges[i].end, buf, buf_len, buf_cap);
+
+    release_snapshot(&snap);
+    return ret;
+}
@@ -0,0 +1,333 @@
+/**
+ * @file load-generator.c
+ * @brief Load generator and latency benchmark for aesdsocket
+ *
+ * Each connection thread sends newline terminated records and waits until its record shows up
+ * in the content the server sends back, which gives the round trip latency of a write. Every
+ * seekto_every requests, the thread sends an AESDCHAR_IOCSEEKTO:x,y command followed by a record
+ * instead, and the time until this record shows up is the latency of the seekto read back.
+ * With a pipeline of more than one record, each request sends that many records in a single
+ * packet and completes when the reply to the last one arrives, which exercises the framing of
+ * several commands received at once. Records carry a fixed width client and sequence number
+ * header so they can not be mistaken for one another. Works against the file and the char
+ * device backends: the file backend ignores the seekto position and sends everything back,
+ * so its replies grow with the file.
+ *
+ * Usage: load-generator [-h host] [-p port] [-c connections] [-n requests] [-P pipeline] [-s min_size[-max_size]]
+ *                       [-r rate] [-k seekto_every] [-x write_cmd,offset] [-t timeout]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define RECV_SIZE (256 * 1024)
+// Record header, "load-cccc-nnnnnnnn:", unique per record
+#define HEADER_FORMAT "load-%04d-%08d:"
+#define HEADER_LEN 19
+
+static const char *host = "localhost";
+static const char *port = "9000";
+static int connections = 8;
+static int requests = 1000;
+static size_t min_size = 64;
+static size_t max_size = 64;
+static double rate = 0;
+static int pipeline = 1;
+static int seekto_every = 0;
+static unsigned int seekto_cmd = 0;
+static unsigned int seekto_offset = 0;
+static int timeout_s = 60;
+static volatile bool stop = false;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    int writes_done;
+    int seektos_done;
+    bool failed;
+    size_t bytes_sent;
+    size_t bytes_received;
+    double finished;
+    double *write_latency;
+    double *seekto_latency;
+} client_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void)
+{
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd != -1) {
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Receives until @param token shows up in the stream, keeping the tail of the
+ * previous chunk so a token split across two recv calls is still found.
+ */
+static int wait_token(int fd, const char *token, size_t token_len, char *buf, size_t *received)
+{
+    size_t kept = 0;
+
+    while (!stop) {
+        ssize_t n = recv(fd, buf + kept, RECV_SIZE - kept, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+            continue;
+        *received += n;
+        size_t len = kept + n;
+        if (memmem(buf, len, token, token_len) != NULL)
+            return 0;
+        kept = len < token_len ? len : token_len - 1;
+        memmove(buf, buf + len - kept, kept);
+    }
+    return -1;
+}
+
+/**
+ * Fills @param record with a record of @param size bytes, header included, ending with a newline
+ */
+static void make_record(char *record, size_t size, int client, int seq)
+{
+    char header[HEADER_LEN + 1];
+
+    snprintf(header, sizeof(header), HEADER_FORMAT, client, seq);
+    memcpy(record, header, HEADER_LEN);
+    memset(record + HEADER_LEN, 'a' + seq % 26, size - HEADER_LEN - 1);
+    record[size - 1] = '\n';
+}
+
+static void *client_thread(void *arg)
+{
+    client_t *client = arg;
+    char *buf = malloc(RECV_SIZE);
+    char seekto[64];
+    int seekto_len = snprintf(seekto, sizeof(seekto), "AESDCHAR_IOCSEEKTO:%u,%u\n", seekto_cmd, seekto_offset);
+    // A request is the optional seekto command followed by pipeline records, sent at once
+    char *batch = malloc(seekto_len + pipeline * max_size);
+    int fd = connect_server();
+    double next_send = now();
+
+    if (fd == -1 || buf == NULL || batch == NULL) {
+        perror("client");
+        client->failed = true;
+        free(buf);
+        free(batch);
+        return NULL;
+    }
+
+    for (int seq = 0; seq < requests && !stop; seq++) {
+        // The first request always writes, so a seekto never reads back an empty device
+        bool is_seekto = seekto_every > 0 && seq > 0 && seq % seekto_every == 0;
+        size_t size = 0;
+        const char *last_record = batch;
+
+        if (rate > 0) {
+            double delay = next_send - now();
+            if (delay > 0)
+                usleep(delay * 1e6);
+            next_send += 1 / rate;
+        }
+
+        if (is_seekto) {
+            memcpy(batch, seekto, seekto_len);
+            size = seekto_len;
+        }
+        for (int i = 0; i < pipeline; i++) {
+            size_t record_size = min_size + (max_size > min_size ? rand_r(&client->seed) % (max_size - min_size + 1) : 0);
+            last_record = batch + size;
+            make_record(batch + size, record_size, client->id, seq * pipeline + i);
+            size += record_size;
+        }
+
+        // The replies come back in order, so the request is done once the last record shows up
+        double start = now();
+        if (send_all(fd, batch, size) != 0 ||
+            wait_token(fd, last_record, HEADER_LEN, buf, &client->bytes_received) != 0) {
+            client->failed = !stop;
+            break;
+        }
+        double latency = now() - start;
+
+        client->bytes_sent += size;
+        if (is_seekto)
+            client->seekto_latency[client->seektos_done++] = latency;
+        else
+            client->write_latency[client->writes_done++] = latency;
+    }
+    client->finished = now();
+    close(fd);
+    free(batch);
+    free(buf);
+    return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p)
+{
+    if (count == 0)
+        return 0;
+    int index = (int)(p * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+/**
+ * Prints the latency distribution of the @param count write or, with @param seekto, seekto requests
+ */
+static void report_latency(const char *name, const client_t *clients, bool seekto, int count)
+{
+    double *all = malloc((count ? count : 1) * sizeof(double));
+    int n = 0;
+    double sum = 0;
+
+    for (int i = 0; i < connections; i++) {
+        const double *samples = seekto ? clients[i].seekto_latency : clients[i].write_latency;
+        int done = seekto ? clients[i].seektos_done : clients[i].writes_done;
+        for (int j = 0; j < done; j++) {
+            all[n++] = samples[j];
+            sum += samples[j];
+        }
+    }
+    qsort(all, n, sizeof(double), compare_double);
+    printf("%s_count=%d %s_mean_us=%.1f %s_p50_us=%.1f %s_p99_us=%.1f %s_p999_us=%.1f %s_max_us=%.1f\n",
+           name, n, name, n ? sum / n * 1e6 : 0, name, percentile(all, n, 0.5) * 1e6,
+           name, percentile(all, n, 0.99) * 1e6, name, percentile(all, n, 0.999) * 1e6,
+           name, n ? all[n - 1] * 1e6 : 0);
+    free(all);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:P:s:r:k:x:t:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'c': connections = atoi(optarg); break;
+            case 'n': requests = atoi(optarg); break;
+            case 'P': pipeline = atoi(optarg); break;
+            case 's':
+                if (sscanf(optarg, "%zu-%zu", &min_size, &max_size) == 1)
+                    max_size = min_size;
+                break;
+            case 'r': rate = atof(optarg); break;
+            case 'k': seekto_every = atoi(optarg); break;
+            case 'x':
+                if (sscanf(optarg, "%u,%u", &seekto_cmd, &seekto_offset) != 2) {
+                    fprintf(stderr, "Invalid seekto position %s, expected write_cmd,offset\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't': timeout_s = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-h host] [-p port] [-c connections] [-n requests] [-P pipeline] [-s min_size[-max_size]]\n"
+                        "          [-r rate] [-k seekto_every] [-x write_cmd,offset] [-t timeout]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (connections < 1 || requests < 1 || pipeline < 1 || min_size <= HEADER_LEN || max_size < min_size) {
+        fprintf(stderr, "Records must be larger than %d bytes, with at least one connection, request and record per request\n", HEADER_LEN);
+        return 1;
+    }
+
+    client_t *clients = calloc(connections, sizeof(client_t));
+    for (int i = 0; i < connections; i++) {
+        clients[i].id = i;
+        clients[i].seed = i + 1;
+        clients[i].write_latency = malloc(requests * sizeof(double));
+        clients[i].seekto_latency = malloc(requests * sizeof(double));
+    }
+
+    double start = now();
+    for (int i = 0; i < connections; i++)
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+
+    // Wake up every 100 ms to check whether the clients are done
+    bool done = false;
+    while (!done && now() - start < timeout_s) {
+        usleep(100000);
+        done = true;
+        for (int i = 0; i < connections; i++) {
+            if (!clients[i].failed && clients[i].writes_done + clients[i].seektos_done < requests)
+                done = false;
+        }
+    }
+    stop = true;
+
+    int total_writes = 0, total_seektos = 0, failed = 0;
+    size_t bytes_sent = 0, bytes_received = 0;
+    double end = start;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        total_writes += clients[i].writes_done;
+        total_seektos += clients[i].seektos_done;
+        bytes_sent += clients[i].bytes_sent;
+        bytes_received += clients[i].bytes_received;
+        failed += clients[i].failed;
+        if (clients[i].finished > end)
+            end = clients[i].finished;
+    }
+    double elapsed = end - start;
+
+    printf("connections=%d pipeline=%d requests=%d/%d elapsed_s=%.3f requests_per_s=%.1f records_per_s=%.1f sent_MBps=%.3f received_MBps=%.3f failed_connections=%d\n",
+           connections, pipeline, total_writes + total_seektos, requests * connections, elapsed,
+           (total_writes + total_seektos) / elapsed, (double)(total_writes + total_seektos) * pipeline / elapsed,
+           bytes_sent / elapsed / 1e6, bytes_received / elapsed / 1e6, failed);
+    report_latency("write", clients, false, total_writes);
+    if (seekto_every > 0)
+        report_latency("seekto", clients, true, total_seektos);
+
+    for (int i = 0; i < connections; i++) {
+        free(clients[i].write_latency);
+        free(clients[i].seekto_latency);
+    }
+    free(clients);
+    return total_writes + total_seektos == requests * connections ? 0 : 1;
+}
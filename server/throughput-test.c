@@ -0,0 +1,261 @@
+/**
+ * @file throughput-test.c
+ * @brief Throughput test of aesdsocket with a mix of slow and fast clients
+ *
+ * The data file is first filled with a large record, so every reply is bigger than the
+ * socket buffers. Slow clients then send one line and read their reply at a trickle,
+ * while fast clients do round trips as quickly as possible. The test fails when the fast
+ * clients do not finish in time, which happens if replies are sent with the data lock held.
+ *
+ * Usage: throughput-test [-h host] [-p port] [-s slow] [-f fast] [-n rounds] [-b prefill_bytes] [-t timeout]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define RECV_SIZE (256 * 1024)
+
+static const char *host = "localhost";
+static const char *port = "9000";
+static int slow_clients = 4;
+static int fast_clients = 4;
+static int rounds = 20;
+static size_t prefill_bytes = 4 * 1024 * 1024;
+static int timeout_s = 60;
+static volatile bool stop = false;
+
+typedef struct {
+    pthread_t thread;
+    int id;
+    int rounds_done;
+    size_t bytes_received;
+} client_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(int rcvbuf)
+{
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd != -1) {
+        if (rcvbuf > 0)
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_line(int fd, const char *line, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, line, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        line += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Receives until @param token shows up in the stream, keeping the tail of the
+ * previous chunk so a token split across two recv calls is still found.
+ */
+static int wait_token(int fd, const char *token, char *buf, size_t *received)
+{
+    size_t token_len = strlen(token);
+    size_t kept = 0;
+
+    while (!stop) {
+        ssize_t n = recv(fd, buf + kept, RECV_SIZE - kept, 0);
+        if (n == 0)
+            return -1;
+        if (n < 0)
+            continue;
+        *received += n;
+        size_t len = kept + n;
+        if (memmem(buf, len, token, token_len) != NULL)
+            return 0;
+        kept = len < token_len ? len : token_len - 1;
+        memmove(buf, buf + len - kept, kept);
+    }
+    return -1;
+}
+
+static void *fast_client(void *arg)
+{
+    client_t *client = arg;
+    char *buf = malloc(RECV_SIZE);
+    int fd = connect_server(0);
+    char token[64];
+
+    if (fd == -1 || buf == NULL) {
+        perror("fast client");
+        free(buf);
+        return NULL;
+    }
+    for (int i = 0; i < rounds && !stop; i++) {
+        int len = snprintf(token, sizeof(token), "fast-%d-%d\n", client->id, i);
+        if (send_line(fd, token, len) != 0 || wait_token(fd, token, buf, &client->bytes_received) != 0)
+            break;
+        client->rounds_done++;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static void *slow_client(void *arg)
+{
+    client_t *client = arg;
+    char buf[1024];
+    int fd = connect_server(4096);
+    char token[64];
+
+    if (fd == -1) {
+        perror("slow client");
+        return NULL;
+    }
+    int len = snprintf(token, sizeof(token), "slow-%d\n", client->id);
+    if (send_line(fd, token, len) == 0) {
+        // Read the reply at about 100 KiB/s until the test ends
+        while (!stop) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n == 0)
+                break;
+            if (n > 0)
+                client->bytes_received += n;
+            usleep(10000);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+static int prefill(void)
+{
+    char *buf = malloc(RECV_SIZE);
+    char *record = malloc(prefill_bytes + 1);
+    size_t received = 0;
+    int fd = connect_server(0);
+    int ret = -1;
+
+    if (fd != -1 && buf != NULL && record != NULL) {
+        memset(record, 'p', prefill_bytes);
+        record[prefill_bytes - 1] = '\n';
+        memcpy(record, "prefill-", 8);
+        record[prefill_bytes] = '\0';
+        // The record is larger than the search window, look for its last bytes
+        if (send_line(fd, record, prefill_bytes) == 0)
+            ret = wait_token(fd, record + prefill_bytes - 64, buf, &received);
+    }
+    if (fd != -1)
+        close(fd);
+    free(record);
+    free(buf);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:s:f:n:b:t:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 's': slow_clients = atoi(optarg); break;
+            case 'f': fast_clients = atoi(optarg); break;
+            case 'n': rounds = atoi(optarg); break;
+            case 'b': prefill_bytes = strtoul(optarg, NULL, 0); break;
+            case 't': timeout_s = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-h host] [-p port] [-s slow] [-f fast] [-n rounds] [-b prefill_bytes] [-t timeout]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (prefill_bytes < 128)
+        prefill_bytes = 128;
+
+    if (prefill() != 0) {
+        fprintf(stderr, "Error filling the data file\n");
+        return 1;
+    }
+
+    client_t *slow = calloc(slow_clients, sizeof(client_t));
+    client_t *fast = calloc(fast_clients, sizeof(client_t));
+    for (int i = 0; i < slow_clients; i++) {
+        slow[i].id = i;
+        pthread_create(&slow[i].thread, NULL, slow_client, &slow[i]);
+    }
+    // Give the slow clients time to get their reply stuck in the socket
+    sleep(1);
+
+    double start = now();
+    for (int i = 0; i < fast_clients; i++) {
+        fast[i].id = i;
+        pthread_create(&fast[i].thread, NULL, fast_client, &fast[i]);
+    }
+
+    // Wake up every 100 ms to check whether the fast clients are done
+    bool done = false;
+    while (!done && now() - start < timeout_s) {
+        usleep(100000);
+        done = true;
+        for (int i = 0; i < fast_clients; i++) {
+            if (fast[i].rounds_done < rounds)
+                done = false;
+        }
+    }
+    double elapsed = now() - start;
+    stop = true;
+
+    int total_rounds = 0;
+    size_t fast_bytes = 0, slow_bytes = 0;
+    for (int i = 0; i < fast_clients; i++) {
+        pthread_join(fast[i].thread, NULL);
+        total_rounds += fast[i].rounds_done;
+        fast_bytes += fast[i].bytes_received;
+    }
+    for (int i = 0; i < slow_clients; i++) {
+        pthread_join(slow[i].thread, NULL);
+        slow_bytes += slow[i].bytes_received;
+    }
+
+    printf("slow_clients=%d fast_clients=%d rounds=%d/%d elapsed_s=%.3f round_trips_per_s=%.1f fast_MBps=%.1f slow_MBps=%.3f\n",
+           slow_clients, fast_clients, total_rounds, rounds * fast_clients, elapsed,
+           total_rounds / elapsed, fast_bytes / elapsed / 1e6, slow_bytes / elapsed / 1e6);
+
+    free(slow);
+    free(fast);
+    if (total_rounds != rounds * fast_clients) {
+        printf("TEST FAILED: fast clients were stalled\n");
+        return 1;
+    }
+    printf("TEST OK\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define NUM_RINGS 4
+#define NUM_WRITES 40
+
+static const uint8_t ring_capacity[NUM_RINGS] = { 1, 3, 10, 32 };
+
+static int freed_count;
+
+static void count_free(const char *buffptr)
+{
+    (void)buffptr;
+    freed_count++;
+}
+
+/**
+ * Writes "ring <ring> write <write>\n" for each write from 0 to @param count to @param buffer,
+ * using strings owned by @param strings
+ */
+static void write_entries(struct aesd_circular_buffer *buffer, char strings[][32], int ring, int count)
+{
+    int write;
+    for (write = 0; write < count; write++)
+    {
+        struct aesd_buffer_entry entry;
+        snprintf(strings[write], 32, "ring %d write %d\n", ring, write);
+        entry.buffptr = strings[write];
+        entry.size = strlen(strings[write]);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Checks @param buffer holds the writes from @param first to @param last of write_entries(), in order
+ */
+static void verify_entries(struct aesd_circular_buffer *buffer, char strings[][32], int first, int last)
+{
+    size_t char_offset = 0;
+    size_t total_size = 0;
+    int write;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(last - first, aesd_circular_buffer_entry_count(buffer),
+            "The buffer should hold the newest entries only");
+    for (write = first; write < last; write++)
+    {
+        size_t entry_offset;
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer,
+                char_offset, &entry_offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "Each entry kept should be found at its offset");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(strings[write], entry->buffptr, "Entries should be kept in write order");
+        TEST_ASSERT_EQUAL_UINT32(0, entry_offset);
+        char_offset += entry->size;
+        total_size += strlen(strings[write]);
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(total_size, buffer->total_size, "total_size should match the entries kept");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &char_offset),
+            "No entry should be found past the end of the buffer");
+}
+
+void test_circular_buffer_rings_of_different_capacity()
+{
+    struct aesd_circular_buffer buffers[NUM_RINGS];
+    static char strings[NUM_RINGS][NUM_WRITES][32];
+    int ring;
+
+    memset(buffers, 0, sizeof(buffers));
+    for (ring = 0; ring < NUM_RINGS; ring++)
+    {
+        aesd_circular_buffer_init(&buffers[ring], ring_capacity[ring]);
+    }
+
+    // Interleave the rings so a capacity shared between them would show
+    for (ring = 0; ring < NUM_RINGS; ring++)
+    {
+        write_entries(&buffers[ring], strings[ring], ring, NUM_WRITES);
+    }
+    for (ring = 0; ring < NUM_RINGS; ring++)
+    {
+        TEST_ASSERT_EQUAL_UINT8(ring_capacity[ring], buffers[ring].capacity);
+        TEST_ASSERT_TRUE_MESSAGE(buffers[ring].full, "Each ring should be full after more writes than its capacity");
+        verify_entries(&buffers[ring], strings[ring], NUM_WRITES - ring_capacity[ring], NUM_WRITES);
+        aesd_circular_buffer_cleanup(&buffers[ring]);
+    }
+}
+
+void test_circular_buffer_resize_keeps_newest_entries()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_circular_buffer other;
+    static char strings[NUM_WRITES][32];
+    static char other_strings[NUM_WRITES][32];
+    struct aesd_buffer_entry entry;
+
+    memset(&buffer, 0, sizeof(buffer));
+    memset(&other, 0, sizeof(other));
+    aesd_circular_buffer_init(&buffer, 10);
+    aesd_circular_buffer_init(&other, 5);
+    write_entries(&buffer, strings, 0, 15);
+    write_entries(&other, other_strings, 1, 3);
+    size_t written_size = buffer.written_size;
+
+    // Shrinking frees the oldest entries and keeps the offsets of the others
+    freed_count = 0;
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 4, count_free));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(6, freed_count, "The 6 oldest entries should be freed");
+    TEST_ASSERT_EQUAL_UINT8(4, buffer.capacity);
+    TEST_ASSERT_EQUAL_UINT32(written_size, buffer.written_size);
+    verify_entries(&buffer, strings, 11, 15);
+
+    // Growing keeps every entry and makes room for more
+    TEST_ASSERT_EQUAL_INT(0, aesd_circular_buffer_resize(&buffer, 6, count_free));
+    TEST_ASSERT_EQUAL_INT(6, freed_count);
+    TEST_ASSERT_FALSE(buffer.full);
+    verify_entries(&buffer, strings, 11, 15);
+    entry.buffptr = strings[15];
+    entry.size = 1;
+    strcpy(strings[15], "x");
+    TEST_ASSERT_NULL(aesd_circular_buffer_add_entry(&buffer, &entry));
+    verify_entries(&buffer, strings, 11, 16);
+
+    // The other ring is unaffected
+    TEST_ASSERT_EQUAL_UINT8(5, other.capacity);
+    verify_entries(&other, other_strings, 0, 3);
+
+    aesd_circular_buffer_cleanup(&buffer);
+    aesd_circular_buffer_cleanup(&other);
+}
@@ -0,0 +1,108 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-newline-scan.h"
+
+#define BUFFER_SIZE 1024
+#define MAX_POSITIONS BUFFER_SIZE
+
+struct scanner
+{
+    const char *name;
+    aesd_newline_scan_fn scan;
+};
+
+static const struct scanner scanners[] = {
+    { "words", aesd_newline_scan_words },
+#ifdef AESD_NEWLINE_SCAN_X86
+    { "sse2", aesd_newline_scan_sse2 },
+#endif
+    { "dispatch", aesd_newline_scan },
+};
+
+static size_t expected[MAX_POSITIONS];
+static size_t found[MAX_POSITIONS];
+
+/**
+ * Checks every scanner finds the same newlines as aesd_newline_scan_bytes() in the @param len
+ * bytes at @param buf, at most @param max_positions of them
+ */
+static void verify_scanners(const char *buf, size_t len, size_t max_positions)
+{
+    size_t expected_count = aesd_newline_scan_bytes(buf, len, expected, max_positions);
+    size_t s;
+
+    for (s = 0; s < sizeof(scanners) / sizeof(scanners[0]); s++)
+    {
+        char message[96];
+        size_t count = scanners[s].scan(buf, len, found, max_positions);
+        snprintf(message, sizeof(message), "%s scanner, length %zu, max %zu", scanners[s].name, len, max_positions);
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_count, count, message);
+        if (count > 0)
+        {
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, found, count * sizeof(size_t), message);
+        }
+    }
+}
+
+void test_newline_scan_finds_every_newline()
+{
+    static char buffer[BUFFER_SIZE + 64];
+    size_t offset, len;
+
+    // Every length and alignment up to a few vector widths, with newlines in about one byte of 8
+    srand(1);
+    for (len = 0; len < 200; len++)
+    {
+        for (offset = 0; offset < 64; offset += 7)
+        {
+            size_t i;
+            for (i = 0; i < len; i++)
+            {
+                buffer[offset + i] = rand() % 8 == 0 ? '\n' : (char)(rand() % 256);
+            }
+            verify_scanners(buffer + offset, len, MAX_POSITIONS);
+        }
+    }
+
+    // Bytes differing from a newline by a single bit or by the borrow of the word scanner
+    int i;
+    memset(buffer, 0, sizeof(buffer));
+    for (i = 0; i < BUFFER_SIZE; i++)
+    {
+        buffer[i] = (char)(i % 3 == 0 ? '\n' ^ (1 << (i % 8)) : '\n' + 1 - (i % 2) * 2);
+    }
+    buffer[5] = '\n';
+    buffer[BUFFER_SIZE - 1] = '\n';
+    verify_scanners(buffer, BUFFER_SIZE, MAX_POSITIONS);
+}
+
+void test_newline_scan_stops_at_max_positions()
+{
+    static char buffer[BUFFER_SIZE];
+    size_t max_positions;
+
+    memset(buffer, '\n', sizeof(buffer));
+    for (max_positions = 0; max_positions < 130; max_positions++)
+    {
+        verify_scanners(buffer, BUFFER_SIZE, max_positions);
+    }
+
+    // Resuming after the last position returned finds the remaining newlines
+    memset(buffer, 'a', sizeof(buffer));
+    size_t i;
+    for (i = 3; i < BUFFER_SIZE; i += 13)
+    {
+        buffer[i] = '\n';
+    }
+    size_t total = 0, start = 0, count;
+    while ((count = aesd_newline_scan(buffer + start, BUFFER_SIZE - start, found, 10)) > 0)
+    {
+        TEST_ASSERT_EQUAL_UINT32(3 + total * 13, start + found[0]);
+        total += count;
+        start += found[count - 1] + 1;
+    }
+    TEST_ASSERT_EQUAL_UINT32((BUFFER_SIZE - 3 + 12) / 13, total);
+}